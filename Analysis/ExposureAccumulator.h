@@ -0,0 +1,478 @@
+// Incremental per-voxel statistics for the exposure-time studies.
+//
+// The time-to-detect macros compare separate reconstructions, one per
+// exposure (..._tracks5_1 ... _tracks5_7), so every new day of muon data
+// meant rerunning the whole discriminator on all tracks so far. Here the
+// sufficient statistics of every voxel (track count, windowed sum and sum of
+// squares, and a small discriminator histogram for the median) are kept on
+// disk. AddTracks() voxelizes only the new tracks and adds them in; the
+// metrics can then be read at the current or any earlier exposure.
+//
+// On disk a state is two files:
+//   <name>           header, batch list and the cumulative statistics
+//   <name>.journal   append-only: for each batch, the voxels it touched
+//                    with their increments
+// All statistics are additive, so the state at an earlier exposure is the
+// cumulative one minus the journal entries of the later batches.
+
+#ifndef EXPOSURE_ACCUMULATOR_H
+#define EXPOSURE_ACCUMULATOR_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "TrackVoxelizer.h"
+#include "VoxelGrid.h"
+
+class ExposureAccumulator {
+public:
+    struct Config {
+        // Voxel grid (mm) and discriminator window, as in TrackVoxelizer
+        TrackVoxelizer::Axis x{33, -495, 495};
+        TrackVoxelizer::Axis y{20, -300, 300};
+        TrackVoxelizer::Axis z{20, -300, 300};
+        double discrMin = 7.0;
+        double discrMax = 14.0;
+        int medianBins = 64;
+        unsigned nThreads = 0;
+    };
+
+    struct Batch {
+        std::string label;
+        double exposure = 0;       // cumulative exposure after the batch (days)
+        Long64_t nTracks = 0;
+        uint64_t journalOffset = 0;
+        uint64_t nRecords = 0;     // voxels touched
+    };
+
+    // Cumulative statistics at one exposure
+    struct State {
+        VoxelGrid::Geometry geometry;
+        Config config;
+        std::vector<DiscrAccumulator> voxels;
+        std::vector<uint32_t> discrHist;   // medianBins per voxel
+
+        // Windowed mean discriminator, 0 for empty voxels
+        VoxelGrid MeanGrid() const {
+            VoxelGrid grid(geometry);
+            for (std::size_t v = 0; v < voxels.size(); v++) grid.Data()[v] = voxels[v].Mean();
+            return grid;
+        }
+
+        // Median of the windowed discriminator, the histMedianMetric of the
+        // discriminator files up to the histogram bin width
+        VoxelGrid MedianGrid() const {
+            VoxelGrid grid(geometry);
+            const int n = config.medianBins;
+            if (n <= 0) return grid;
+            for (std::size_t v = 0; v < voxels.size(); v++) {
+                grid.Data()[v] = HistogramMedian(&discrHist[v * n], n, config.discrMin, config.discrMax);
+            }
+            return grid;
+        }
+
+        VoxelGrid CountGrid() const {
+            VoxelGrid grid(geometry);
+            for (std::size_t v = 0; v < voxels.size(); v++) grid.Data()[v] = voxels[v].count;
+            return grid;
+        }
+
+        // BinaryMap.C on the median: 1 where a region's threshold is passed
+        VoxelGrid BinaryMap(const std::vector<CylinderRegion>& regions) const {
+            VoxelGrid median = MedianGrid();
+            VoxelGrid binaryMap(geometry);
+            for (const auto& region : regions) {
+                binaryMap.Assign(median.Threshold(median.Region(region), region.threshold), 1.);
+            }
+            return binaryMap;
+        }
+    };
+
+    explicit ExposureAccumulator(const Config& config) : config_(config) {
+        state_.config = config;
+        state_.geometry = MakeGeometry(config);
+        state_.voxels.resize(state_.geometry.NVoxels());
+        state_.discrHist.assign(state_.geometry.NVoxels() * config.medianBins, 0);
+    }
+
+    // Reads a saved state, nullptr if filename is not one or if its sizes do
+    // not match the file and its journal
+    static std::unique_ptr<ExposureAccumulator> Load(const std::string& filename) {
+        std::unique_ptr<FILE, int (*)(FILE*)> in(std::fopen(filename.c_str(), "rb"), std::fclose);
+        if (!in) {
+            std::cerr << "Cannot open exposure state " << filename << std::endl;
+            return nullptr;
+        }
+        Header header;
+        if (std::fread(&header, sizeof(header), 1, in.get()) != 1 ||
+            std::memcmp(header.magic, kMagic, sizeof(header.magic)) != 0 ||
+            header.version != kVersion) {
+            std::cerr << "Not an exposure state: " << filename << std::endl;
+            return nullptr;
+        }
+        if (!ValidHeader(header, FileSize(filename))) {
+            std::cerr << "Corrupt exposure state " << filename << std::endl;
+            return nullptr;
+        }
+
+        Config config;
+        config.x = {header.nBins[0], header.min[0], header.max[0]};
+        config.y = {header.nBins[1], header.min[1], header.max[1]};
+        config.z = {header.nBins[2], header.min[2], header.max[2]};
+        config.discrMin = header.discrMin;
+        config.discrMax = header.discrMax;
+        config.medianBins = header.medianBins;
+        std::unique_ptr<ExposureAccumulator> acc(new ExposureAccumulator(config));
+        acc->filename_ = filename;
+
+        bool ok = true;
+        for (uint32_t b = 0; ok && b < header.nBatches; b++) {
+            BatchRecord record;
+            ok = std::fread(&record, sizeof(record), 1, in.get()) == 1;
+            Batch batch;
+            batch.label = record.label;
+            batch.exposure = record.exposure;
+            batch.nTracks = record.nTracks;
+            batch.journalOffset = record.journalOffset;
+            batch.nRecords = record.nRecords;
+            acc->batches_.push_back(batch);
+        }
+        State& s = acc->state_;
+        ok = ok && std::fread(s.voxels.data(), sizeof(DiscrAccumulator), s.voxels.size(), in.get()) == s.voxels.size();
+        ok = ok && std::fread(s.discrHist.data(), sizeof(uint32_t), s.discrHist.size(), in.get()) == s.discrHist.size();
+        if (!ok) {
+            std::cerr << "Truncated exposure state " << filename << std::endl;
+            return nullptr;
+        }
+
+        // Every batch must lie inside the journal before it can be replayed
+        const uint64_t journalSize = header.nBatches ? FileSize(acc->JournalName()) : 0;
+        for (const auto& batch : acc->batches_) {
+            if (batch.nRecords > s.voxels.size() || batch.journalOffset > journalSize ||
+                batch.nRecords * acc->RecordBytes() > journalSize - batch.journalOffset) {
+                std::cerr << "Journal " << acc->JournalName() << " does not hold batch "
+                          << batch.label << std::endl;
+                return nullptr;
+            }
+        }
+        acc->savedBatches_ = acc->batches_.size();
+        return acc;
+    }
+
+    // Voxelizes entries [firstEntry, lastEntry) of the T tree of treeFile and
+    // adds them as one batch, bringing the total exposure to `exposure`
+    bool AddTracks(const char* treeFile, double exposure, const std::string& label,
+                   Long64_t firstEntry = 0, Long64_t lastEntry = -1) {
+        TrackVoxelizer::Config vc;
+        vc.x = config_.x;
+        vc.y = config_.y;
+        vc.z = config_.z;
+        vc.slices.nBins = 0;
+        vc.discrMin = config_.discrMin;
+        vc.discrMax = config_.discrMax;
+        vc.medianBins = config_.medianBins;
+        vc.nThreads = config_.nThreads;
+        TrackVoxelizer::Result result = TrackVoxelizer(vc).Process(treeFile, firstEntry, lastEntry);
+        if (result.nEntries <= 0) return false;
+
+        // Keep the increments of the touched voxels for the journal
+        Delta delta;
+        delta.batch.label = label;
+        delta.batch.exposure = exposure;
+        delta.batch.nTracks = result.nEntries;
+        const int n = config_.medianBins;
+        for (std::size_t v = 0; v < result.voxels.size(); v++) {
+            if (result.voxels[v].count == 0) continue;
+            delta.voxels.push_back(v);
+            delta.stats.push_back(result.voxels[v]);
+            delta.hist.insert(delta.hist.end(), &result.discrHist[v * n], &result.discrHist[v * n] + n);
+            state_.voxels[v].Merge(result.voxels[v]);
+            for (int b = 0; b < n; b++) state_.discrHist[v * n + b] += result.discrHist[v * n + b];
+        }
+        delta.batch.nRecords = delta.voxels.size();
+        batches_.push_back(delta.batch);
+        pending_.push_back(std::move(delta));
+        return true;
+    }
+
+    // Appends the new batches to the journal, then writes the cumulative
+    // state to a temporary file renamed over the old one, so that a failed
+    // save leaves the previous state intact. The batches only count as saved
+    // once both writes succeeded; journal bytes of a failed save are never
+    // referenced and the next save appends after them.
+    bool Save(const std::string& filename) {
+        if (filename != filename_ && !filename_.empty()) {
+            std::cerr << "An exposure state is saved under the name it was loaded from" << std::endl;
+            return false;
+        }
+        // A new state starts a new journal
+        const std::string journalName = filename + ".journal";
+        const char* mode = filename_.empty() ? "wb" : "ab";
+
+        std::vector<Batch> batches = batches_;
+        {
+            std::unique_ptr<FILE, int (*)(FILE*)> journal(std::fopen(journalName.c_str(), mode), std::fclose);
+            if (!journal) {
+                std::cerr << "Cannot write journal " << journalName << std::endl;
+                return false;
+            }
+            bool ok = std::fseek(journal.get(), 0, SEEK_END) == 0;
+            for (std::size_t p = 0; ok && p < pending_.size(); p++) {
+                const Delta& delta = pending_[p];
+                batches[savedBatches_ + p].journalOffset = std::ftell(journal.get());
+                const std::size_t nr = delta.voxels.size();
+                ok = std::fwrite(delta.voxels.data(), sizeof(uint32_t), nr, journal.get()) == nr;
+                ok = ok && std::fwrite(delta.stats.data(), sizeof(DiscrAccumulator), nr, journal.get()) == nr;
+                ok = ok && std::fwrite(delta.hist.data(), sizeof(uint32_t), delta.hist.size(), journal.get()) == delta.hist.size();
+            }
+            ok = ok && Sync(journal.get());
+            if (!ok) {
+                std::cerr << "Error writing journal " << journalName << std::endl;
+                return false;
+            }
+        }
+
+        const std::string tmpName = filename + ".tmp";
+        std::unique_ptr<FILE, int (*)(FILE*)> out(std::fopen(tmpName.c_str(), "wb"), std::fclose);
+        if (!out) {
+            std::cerr << "Cannot write exposure state " << tmpName << std::endl;
+            return false;
+        }
+        Header header;
+        std::memcpy(header.magic, kMagic, sizeof(header.magic));
+        header.version = kVersion;
+        header.nBatches = batches.size();
+        const TrackVoxelizer::Axis* axes[3] = {&config_.x, &config_.y, &config_.z};
+        for (int a = 0; a < 3; a++) {
+            header.nBins[a] = axes[a]->nBins;
+            header.min[a] = axes[a]->min;
+            header.max[a] = axes[a]->max;
+        }
+        header.discrMin = config_.discrMin;
+        header.discrMax = config_.discrMax;
+        header.medianBins = config_.medianBins;
+        bool ok = std::fwrite(&header, sizeof(header), 1, out.get()) == 1;
+        for (const auto& batch : batches) {
+            BatchRecord record;
+            std::memset(&record, 0, sizeof(record));
+            std::strncpy(record.label, batch.label.c_str(), sizeof(record.label) - 1);
+            record.exposure = batch.exposure;
+            record.nTracks = batch.nTracks;
+            record.journalOffset = batch.journalOffset;
+            record.nRecords = batch.nRecords;
+            ok = ok && std::fwrite(&record, sizeof(record), 1, out.get()) == 1;
+        }
+        const State& s = state_;
+        ok = ok && std::fwrite(s.voxels.data(), sizeof(DiscrAccumulator), s.voxels.size(), out.get()) == s.voxels.size();
+        ok = ok && std::fwrite(s.discrHist.data(), sizeof(uint32_t), s.discrHist.size(), out.get()) == s.discrHist.size();
+        ok = ok && Sync(out.get());
+        ok = std::fclose(out.release()) == 0 && ok;
+        ok = ok && std::rename(tmpName.c_str(), filename.c_str()) == 0;
+        if (!ok) {
+            std::cerr << "Error writing exposure state " << filename << std::endl;
+            std::remove(tmpName.c_str());
+            return false;
+        }
+
+        filename_ = filename;
+        batches_ = batches;
+        savedBatches_ = batches_.size();
+        pending_.clear();
+        return true;
+    }
+
+    const std::vector<Batch>& Batches() const { return batches_; }
+    double Exposure() const { return batches_.empty() ? 0. : batches_.back().exposure; }
+    const State& Current() const { return state_; }
+
+    // Statistics after the last batch with exposure <= `exposure`. Only the
+    // journal entries of the later batches are read; for a whole series use
+    // Replay, which reads every batch once.
+    State At(double exposure) const {
+        State s = state_;
+        for (std::size_t b = batches_.size(); b-- > 0 && batches_[b].exposure > exposure;) {
+            Delta delta;
+            if (!ReadDelta(b, delta)) {
+                std::cerr << "Cannot read batch " << batches_[b].label << " from the journal" << std::endl;
+                break;
+            }
+            Apply(delta, -1, s);
+        }
+        return s;
+    }
+
+    // Forward walk over the exposures, starting from no tracks and adding
+    // the batches in order, so a series over all exposures reads every
+    // journal entry once instead of once per later point as with At()
+    class Replay {
+    public:
+        explicit Replay(const ExposureAccumulator& acc) : acc_(acc) {
+            state_.config = acc.config_;
+            state_.geometry = acc.state_.geometry;
+            state_.voxels.resize(state_.geometry.NVoxels());
+            state_.discrHist.assign(acc.state_.discrHist.size(), 0);
+        }
+
+        // Adds the batches with exposure <= `exposure`, false if one of
+        // them cannot be read from the journal
+        bool AdvanceTo(double exposure) {
+            const auto& batches = acc_.batches_;
+            for (; next_ < batches.size() && batches[next_].exposure <= exposure; next_++) {
+                Delta delta;
+                if (!acc_.ReadDelta(next_, delta)) {
+                    std::cerr << "Cannot read batch " << batches[next_].label << " from the journal" << std::endl;
+                    return false;
+                }
+                Apply(delta, +1, state_);
+            }
+            return true;
+        }
+
+        const State& Get() const { return state_; }
+        double Exposure() const { return next_ ? acc_.batches_[next_ - 1].exposure : 0.; }
+
+    private:
+        const ExposureAccumulator& acc_;
+        State state_;
+        std::size_t next_ = 0;
+    };
+
+    // Coordinates of VoxelGrid::FromHistogram, X(i) = (i + 1 - nx/2) * dX, so
+    // that masks and thresholds select the same voxels as in BinaryMap.C on
+    // a discriminator file of the same binning
+    static VoxelGrid::Geometry MakeGeometry(const Config& config) {
+        VoxelGrid::Geometry g;
+        g.nx = config.x.nBins;
+        g.ny = config.y.nBins;
+        g.nz = config.z.nBins;
+        g.xMin = config.x.min;
+        g.xMax = config.x.max;
+        g.yMin = config.y.min;
+        g.yMax = config.y.max;
+        g.zMin = config.z.min;
+        g.zMax = config.z.max;
+        g.dX = config.x.Width();
+        g.dY = config.y.Width();
+        g.dZ = config.z.Width();
+        g.centreX = g.nx / 2;
+        g.centreY = g.ny / 2;
+        g.centreZ = g.nz / 2;
+        return g;
+    }
+
+private:
+    static constexpr const char* kMagic = "EXPACC\0";
+    static const uint32_t kVersion = 1;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t nBatches;
+        int32_t nBins[3];
+        int32_t medianBins;
+        double min[3];
+        double max[3];
+        double discrMin;
+        double discrMax;
+    };
+
+    struct BatchRecord {
+        char label[64];
+        double exposure;
+        int64_t nTracks;
+        uint64_t journalOffset;
+        uint64_t nRecords;
+    };
+
+    // Increments of one batch, only the voxels it touched
+    struct Delta {
+        Batch batch;
+        std::vector<uint32_t> voxels;
+        std::vector<DiscrAccumulator> stats;
+        std::vector<uint32_t> hist;
+    };
+
+    Config config_;
+    State state_;
+    std::vector<Batch> batches_;
+    std::vector<Delta> pending_;       // batches not yet in the journal
+    std::size_t savedBatches_ = 0;
+    std::string filename_;
+
+    std::string JournalName() const { return filename_ + ".journal"; }
+
+    // Journal bytes of one touched voxel
+    uint64_t RecordBytes() const {
+        return sizeof(uint32_t) + sizeof(DiscrAccumulator) + (uint64_t)config_.medianBins * sizeof(uint32_t);
+    }
+
+    static uint64_t FileSize(const std::string& filename) {
+        struct stat st;
+        return stat(filename.c_str(), &st) == 0 ? st.st_size : 0;
+    }
+
+    // Positive binning and a state that fills the file exactly, checked
+    // before anything is allocated from the header
+    static bool ValidHeader(const Header& header, uint64_t fileSize) {
+        const int kMaxBins = 1 << 16;
+        uint64_t nVoxels = 1;
+        for (int a = 0; a < 3; a++) {
+            if (header.nBins[a] <= 0 || header.nBins[a] > kMaxBins || !(header.min[a] < header.max[a])) return false;
+            nVoxels *= header.nBins[a];
+        }
+        if (header.medianBins < 0 || header.medianBins > kMaxBins || !(header.discrMin < header.discrMax)) return false;
+        const uint64_t perVoxel = sizeof(DiscrAccumulator) + (uint64_t)header.medianBins * sizeof(uint32_t);
+        const uint64_t fixed = sizeof(Header) + (uint64_t)header.nBatches * sizeof(BatchRecord);
+        if (fileSize < fixed || nVoxels > (fileSize - fixed) / perVoxel) return false;
+        return fixed + nVoxels * perVoxel == fileSize;
+    }
+
+    // Adds (sign +1) or removes (sign -1) the increments of one batch
+    static void Apply(const Delta& delta, int sign, State& s) {
+        const int n = s.config.medianBins;
+        for (std::size_t r = 0; r < delta.voxels.size(); r++) {
+            DiscrAccumulator& acc = s.voxels[delta.voxels[r]];
+            acc.count += sign * delta.stats[r].count;
+            acc.nWindow += sign * delta.stats[r].nWindow;
+            acc.sum += sign * delta.stats[r].sum;
+            acc.sumSq += sign * delta.stats[r].sumSq;
+            uint32_t* bins = &s.discrHist[(std::size_t)delta.voxels[r] * n];
+            for (int i = 0; i < n; i++) bins[i] += sign * (int64_t)delta.hist[r * n + i];
+        }
+    }
+
+    // Flushes f down to the disk
+    static bool Sync(FILE* f) {
+        return std::fflush(f) == 0 && fsync(fileno(f)) == 0;
+    }
+
+    bool ReadDelta(std::size_t b, Delta& delta) const {
+        // Batches added since the last Save are still in memory
+        if (b >= savedBatches_) {
+            delta = pending_[b - savedBatches_];
+            return true;
+        }
+        std::unique_ptr<FILE, int (*)(FILE*)> in(std::fopen(JournalName().c_str(), "rb"), std::fclose);
+        if (!in) return false;
+        const Batch& batch = batches_[b];
+        const std::size_t nr = batch.nRecords;
+        delta.voxels.resize(nr);
+        delta.stats.resize(nr);
+        delta.hist.resize(nr * config_.medianBins);
+        bool ok = std::fseek(in.get(), batch.journalOffset, SEEK_SET) == 0;
+        ok = ok && std::fread(delta.voxels.data(), sizeof(uint32_t), nr, in.get()) == nr;
+        ok = ok && std::fread(delta.stats.data(), sizeof(DiscrAccumulator), nr, in.get()) == nr;
+        ok = ok && std::fread(delta.hist.data(), sizeof(uint32_t), delta.hist.size(), in.get()) == delta.hist.size();
+        for (std::size_t r = 0; ok && r < nr; r++) ok = delta.voxels[r] < state_.voxels.size();
+        return ok;
+    }
+};
+
+#endif
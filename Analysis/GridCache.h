@@ -0,0 +1,187 @@
+// Bounded cache of VoxelGrids read from discriminator files.
+//
+// The exposure-time macros reopened and deserialized the same reference
+// histBS for every bubble volume. GridCache loads each (file, histogram)
+// pair once and hands out shared, read-only grids. Several threads may ask
+// for the same key at once: the first one loads it, the others wait on the
+// same future. Least recently used grids are dropped when the total size
+// exceeds the byte budget; grids still held by a caller stay alive until
+// released. A .voxmap next to the ROOT file (see VoxelMapFile.h) is read in
+// place of it.
+
+#ifndef GRID_CACHE_H
+#define GRID_CACHE_H
+
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+
+#include "TFile.h"
+#include "TH3.h"
+#include "TROOT.h"
+
+#include "VoxelGrid.h"
+#include "VoxelMapFile.h"
+
+class GridCache {
+public:
+    typedef std::shared_ptr<const VoxelGrid> GridPtr;
+
+    struct Stats {
+        std::size_t hits = 0;
+        std::size_t loads = 0;
+        std::size_t evictions = 0;
+        std::size_t failures = 0;
+        std::size_t bytes = 0;
+    };
+
+    // A budget of 0 takes a quarter of the physical memory
+    explicit GridCache(std::size_t maxBytes = 0) : maxBytes_(maxBytes ? maxBytes : DefaultBudget()) {
+        ROOT::EnableThreadSafety();
+    }
+
+    // Returns the grid of histogram histName in filename, nullptr on failure
+    GridPtr Get(const std::string& filename, const std::string& histName) {
+        const std::string key = filename + "#" + histName;
+        std::shared_future<GridPtr> pending;
+        bool loader = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = entries_.find(key);
+            if (it != entries_.end()) {
+                stats_.hits++;
+                lru_.splice(lru_.begin(), lru_, it->second.position);
+                return it->second.grid;
+            }
+            auto inFlight = loading_.find(key);
+            if (inFlight != loading_.end()) {
+                stats_.hits++;
+                pending = inFlight->second;
+            } else {
+                loader = true;
+                std::promise<GridPtr> promise;
+                pending = promise.get_future().share();
+                loading_[key] = pending;
+                promises_[key] = std::move(promise);
+            }
+        }
+        if (!loader) return pending.get();
+
+        // Only this thread reads the file for this key. If the load throws
+        // (e.g. std::bad_alloc), the waiting threads get the exception and
+        // the key is dropped so that a later Get tries again.
+        GridPtr grid;
+        try {
+            grid = Load(filename, histName);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stats_.failures++;
+            promises_[key].set_exception(std::current_exception());
+            promises_.erase(key);
+            loading_.erase(key);
+            throw;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (grid) {
+                stats_.loads++;
+                Insert(key, grid);
+            } else {
+                stats_.failures++;
+            }
+            promises_[key].set_value(grid);
+            promises_.erase(key);
+            loading_.erase(key);
+        }
+        return grid;
+    }
+
+    Stats GetStats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Stats stats = stats_;
+        stats.bytes = bytes_;
+        return stats;
+    }
+
+    std::size_t MaxBytes() const { return maxBytes_; }
+
+    // Loads one histogram into a flat grid, the file is closed on return
+    static GridPtr Load(const std::string& filename, const std::string& histName) {
+        std::unique_ptr<VoxelGrid> grid = LoadOwned(filename, histName);
+        if (!grid) return nullptr;
+        return GridPtr(std::move(grid));
+    }
+
+    // Same, for callers that adjust the grid (e.g. SetVoxelSize) without
+    // going through the cache
+    static std::unique_ptr<VoxelGrid> LoadOwned(const std::string& filename, const std::string& histName) {
+        const std::string mapPath = VoxelMapFile::PathFor(filename);
+        if (VoxelMapFile::Exists(mapPath)) {
+            auto map = VoxelMapFile::Open(mapPath);
+            if (map && map->Has(histName)) return std::make_unique<VoxelGrid>(map->Grid(histName));
+        }
+
+        std::unique_ptr<TFile> file(TFile::Open(filename.c_str(), "READ"));
+        if (!file || file->IsZombie()) {
+            std::cerr << "Error opening file: " << filename << std::endl;
+            return nullptr;
+        }
+        std::unique_ptr<TH3> hist(dynamic_cast<TH3*>(file->Get(histName.c_str())));
+        if (!hist) {
+            std::cerr << "No " << histName << " in " << filename << std::endl;
+            return nullptr;
+        }
+        hist->SetDirectory(0);
+        return std::make_unique<VoxelGrid>(VoxelGrid::FromHistogram(hist.get()));
+    }
+
+private:
+    struct Entry {
+        GridPtr grid;
+        std::size_t bytes;
+        std::list<std::string>::iterator position;
+    };
+
+    std::size_t maxBytes_;
+    std::size_t bytes_ = 0;
+    Stats stats_;
+    mutable std::mutex mutex_;
+    std::map<std::string, Entry> entries_;
+    std::list<std::string> lru_;  // most recently used first
+    std::map<std::string, std::shared_future<GridPtr>> loading_;
+    std::map<std::string, std::promise<GridPtr>> promises_;
+
+    static std::size_t DefaultBudget() {
+        long pages = sysconf(_SC_PHYS_PAGES);
+        long pageSize = sysconf(_SC_PAGE_SIZE);
+        if (pages <= 0 || pageSize <= 0) return (std::size_t)2 << 30;
+        return (std::size_t)pages * pageSize / 4;
+    }
+
+    // Called with the mutex held
+    void Insert(const std::string& key, const GridPtr& grid) {
+        std::size_t bytes = grid->Size() * sizeof(float);
+        lru_.push_front(key);
+        entries_[key] = Entry{grid, bytes, lru_.begin()};
+        bytes_ += bytes;
+
+        // Keep at least the newest grid even if it alone exceeds the budget
+        while (bytes_ > maxBytes_ && lru_.size() > 1) {
+            const std::string& oldest = lru_.back();
+            auto it = entries_.find(oldest);
+            bytes_ -= it->second.bytes;
+            entries_.erase(it);
+            lru_.pop_back();
+            stats_.evictions++;
+        }
+    }
+};
+
+#endif
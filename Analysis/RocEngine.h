@@ -0,0 +1,376 @@
+// In-process ROC analysis, replacing the text-file round trip to ROCinR.R.
+//
+// Efficiency and purity for every cut come from one suffix sum over the
+// signal and background histograms (calcEffPurity.C and Eff.C called
+// Integral(bin, nBins) inside the bin loop). For unbinned voxel scores the
+// ROC curve and AUC come from a single sort; the AUC uncertainty is given
+// both by DeLong's method and by a stratified bootstrap run on a thread pool,
+// the two intervals pROC::ci.auc offers.
+
+#ifndef ROC_ENGINE_H
+#define ROC_ENGINE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "TH1.h"
+
+#include "ThreadPool.h"
+
+// Efficiency and purity as a function of a lower cut on the metric
+struct EffPurityCurve {
+    std::vector<double> cut;            // lower edge of the first accepted bin
+    std::vector<double> efficiency;     // accepted signal / all signal
+    std::vector<double> efficiencyError;
+    std::vector<double> purity;         // accepted signal / all accepted
+    std::vector<double> signalAccepted;
+    std::vector<double> backgroundAccepted;
+};
+
+struct RocCurve {
+    std::vector<double> falsePositiveRate;  // background accepted fraction
+    std::vector<double> truePositiveRate;   // signal efficiency
+    std::vector<double> threshold;
+    double auc = 0;
+};
+
+struct AucInterval {
+    double auc = 0;
+    double lower = 0;
+    double upper = 0;
+    double sigma = 0;
+};
+
+class RocEngine {
+public:
+    // -----------------------------------------------------------------
+    // Binned input
+
+    // Cut on bin b keeps bins b..nBins, as hSignal->Integral(b, nBins) did
+    static EffPurityCurve EffPurity(const TH1* hSignal, const TH1* hBackground) {
+        int nBins = hSignal->GetNbinsX();
+        std::vector<double> s(nBins + 2), b(nBins + 2);
+        for (int bin = 0; bin <= nBins + 1; bin++) {
+            s[bin] = hSignal->GetBinContent(bin);
+            b[bin] = hBackground->GetBinContent(bin);
+        }
+        EffPurityCurve curve = EffPurity(s, b);
+        for (int bin = 1; bin <= nBins; bin++) {
+            curve.cut[bin - 1] = hSignal->GetBinLowEdge(bin);
+        }
+        return curve;
+    }
+
+    // Same on raw bin contents, index 0 and n+1 being under- and overflow
+    // (not accepted by any cut, as in the macros).
+    static EffPurityCurve EffPurity(const std::vector<double>& s, const std::vector<double>& b) {
+        int nBins = (int)s.size() - 2;
+        double totalSignal = 0;
+        for (int bin = 1; bin <= nBins; bin++) totalSignal += s[bin];
+
+        EffPurityCurve curve;
+        curve.cut.assign(nBins, 0.);
+        curve.efficiency.assign(nBins, 0.);
+        curve.efficiencyError.assign(nBins, 0.);
+        curve.purity.assign(nBins, 0.);
+        curve.signalAccepted.assign(nBins, 0.);
+        curve.backgroundAccepted.assign(nBins, 0.);
+
+        double sumS = 0, sumB = 0;
+        for (int bin = nBins; bin >= 1; bin--) {
+            sumS += s[bin];
+            sumB += b[bin];
+            int i = bin - 1;
+            curve.cut[i] = bin;
+            curve.signalAccepted[i] = sumS;
+            curve.backgroundAccepted[i] = sumB;
+            double eff = totalSignal > 0 ? sumS / totalSignal : 0.;
+            curve.efficiency[i] = eff;
+            curve.efficiencyError[i] = totalSignal > 0 ? std::sqrt(eff * (1 - eff) / totalSignal) : 0.;
+            curve.purity[i] = sumS + sumB > 0 ? sumS / (sumS + sumB) : 0.;
+        }
+        return curve;
+    }
+
+    // ROC and AUC from two histograms with the same binning. Entries in
+    // the same bin count as ties.
+    static RocCurve FromHistograms(const TH1* hSignal, const TH1* hBackground) {
+        int nBins = hSignal->GetNbinsX();
+        double totalS = 0, totalB = 0;
+        for (int bin = 0; bin <= nBins + 1; bin++) {
+            totalS += hSignal->GetBinContent(bin);
+            totalB += hBackground->GetBinContent(bin);
+        }
+
+        RocCurve roc;
+        roc.falsePositiveRate.push_back(0.);
+        roc.truePositiveRate.push_back(0.);
+        roc.threshold.push_back(INFINITY);
+        if (totalS <= 0 || totalB <= 0) return roc;
+
+        double sumS = 0, sumB = 0, area = 0;
+        for (int bin = nBins + 1; bin >= 0; bin--) {
+            double s = hSignal->GetBinContent(bin);
+            double b = hBackground->GetBinContent(bin);
+            area += s * (sumB + 0.5 * b);
+            sumS += s;
+            sumB += b;
+            roc.falsePositiveRate.push_back(sumB / totalB);
+            roc.truePositiveRate.push_back(sumS / totalS);
+            roc.threshold.push_back(hSignal->GetBinLowEdge(bin));
+        }
+        // area counts pairs with the background above the signal
+        roc.auc = 1. - area / (totalS * totalB);
+        return roc;
+    }
+
+    // -----------------------------------------------------------------
+    // Unbinned scores, higher = more signal-like
+
+    static RocCurve FromScores(const std::vector<double>& signal, const std::vector<double>& background) {
+        std::vector<std::pair<double, bool>> all;
+        all.reserve(signal.size() + background.size());
+        for (double v : signal) all.emplace_back(v, true);
+        for (double v : background) all.emplace_back(v, false);
+        std::sort(all.begin(), all.end(), [](const std::pair<double, bool>& a,
+                                             const std::pair<double, bool>& b) {
+            return a.first > b.first;
+        });
+
+        RocCurve roc;
+        roc.falsePositiveRate.push_back(0.);
+        roc.truePositiveRate.push_back(0.);
+        roc.threshold.push_back(INFINITY);
+        if (signal.empty() || background.empty()) return roc;
+
+        double nS = signal.size(), nB = background.size();
+        double tp = 0, fp = 0;
+        for (std::size_t i = 0; i < all.size();) {
+            // One ROC point per distinct score
+            double score = all[i].first;
+            for (; i < all.size() && all[i].first == score; i++) {
+                if (all[i].second) tp++;
+                else fp++;
+            }
+            roc.falsePositiveRate.push_back(fp / nB);
+            roc.truePositiveRate.push_back(tp / nS);
+            roc.threshold.push_back(score);
+        }
+        roc.auc = Auc(signal, background);
+        return roc;
+    }
+
+    // Mann-Whitney AUC, ties counted one half
+    static double Auc(std::vector<double> signal, std::vector<double> background) {
+        if (signal.empty() || background.empty()) return 0.;
+        std::sort(background.begin(), background.end());
+        double sum = 0;
+        for (double v : signal) sum += Placement(background, v);
+        return sum / signal.size();
+    }
+
+    // DeLong et al. (1988) variance of the AUC and the normal interval
+    static AucInterval DeLong(const std::vector<double>& signal, const std::vector<double>& background,
+                              double confidence = 0.95) {
+        AucInterval result;
+        std::size_t m = signal.size(), n = background.size();
+        if (m < 2 || n < 2) return result;
+
+        std::vector<double> sortedB(background), sortedS(signal);
+        std::sort(sortedB.begin(), sortedB.end());
+        std::sort(sortedS.begin(), sortedS.end());
+
+        // Structural components: V10 for each signal, V01 for each background
+        std::vector<double> v10(m), v01(n);
+        for (std::size_t i = 0; i < m; i++) v10[i] = Placement(sortedB, signal[i]);
+        for (std::size_t j = 0; j < n; j++) v01[j] = 1. - Placement(sortedS, background[j]);
+
+        double auc = 0;
+        for (double v : v10) auc += v;
+        auc /= m;
+
+        double s10 = 0, s01 = 0;
+        for (double v : v10) s10 += (v - auc) * (v - auc);
+        for (double v : v01) s01 += (v - auc) * (v - auc);
+        s10 /= (m - 1);
+        s01 /= (n - 1);
+
+        result.auc = auc;
+        result.sigma = std::sqrt(s10 / m + s01 / n);
+        double z = NormalQuantile(0.5 + confidence / 2);
+        result.lower = std::max(0., auc - z * result.sigma);
+        result.upper = std::min(1., auc + z * result.sigma);
+        return result;
+    }
+
+    // Stratified bootstrap: signal and background are resampled separately.
+    // Every replicate has its own seed, so the interval does not depend on
+    // how the replicates are split over the nThreads workers.
+    static AucInterval Bootstrap(const std::vector<double>& signal, const std::vector<double>& background,
+                                 int nReplicates = 2000, double confidence = 0.95,
+                                 unsigned nThreads = 0, uint64_t seed = 20220101) {
+        AucInterval result;
+        result.auc = Auc(signal, background);
+        if (signal.empty() || background.empty() || nReplicates < 2) return result;
+
+        std::vector<double> aucs(nReplicates);
+        {
+            ThreadPool pool(nThreads);
+            unsigned nChunks = pool.Size();
+            int chunk = (nReplicates + nChunks - 1) / nChunks;
+            std::vector<std::future<void>> pending;
+            for (unsigned c = 0; c < nChunks; c++) {
+                int first = c * chunk;
+                int last = std::min(nReplicates, first + chunk);
+                if (first >= last) break;
+                pending.push_back(pool.Submit([&, first, last]() {
+                    std::uniform_int_distribution<std::size_t> pickS(0, signal.size() - 1);
+                    std::uniform_int_distribution<std::size_t> pickB(0, background.size() - 1);
+                    std::vector<double> s(signal.size()), b(background.size());
+                    for (int r = first; r < last; r++) {
+                        std::mt19937_64 rng(seed * 1000003 + r);
+                        pickS.reset();
+                        pickB.reset();
+                        for (auto& v : s) v = signal[pickS(rng)];
+                        for (auto& v : b) v = background[pickB(rng)];
+                        aucs[r] = Auc(s, b);
+                    }
+                }));
+            }
+            for (auto& future : pending) future.get();
+        }
+
+        std::sort(aucs.begin(), aucs.end());
+        double alpha = (1 - confidence) / 2;
+        result.lower = Quantile(aucs, alpha);
+        result.upper = Quantile(aucs, 1 - alpha);
+
+        double mean = 0, var = 0;
+        for (double a : aucs) mean += a;
+        mean /= aucs.size();
+        for (double a : aucs) var += (a - mean) * (a - mean);
+        result.sigma = std::sqrt(var / (aucs.size() - 1));
+        return result;
+    }
+
+    // -----------------------------------------------------------------
+    // Text I/O
+
+    // Purity and efficiency per cut, the two columns of Logfiles/Roc*.txt
+    static bool WriteCurve(const char* filename, const EffPurityCurve& curve) {
+        std::ofstream out(filename);
+        if (!out) {
+            std::cerr << "Cannot write " << filename << std::endl;
+            return false;
+        }
+        for (std::size_t i = 0; i < curve.purity.size(); i++) {
+            out << curve.purity[i] << "\t" << curve.efficiency[i] << "\n";
+        }
+        return true;
+    }
+
+    static EffPurityCurve ReadCurve(const char* filename) {
+        EffPurityCurve curve;
+        std::ifstream in(filename);
+        if (!in) {
+            std::cerr << "Cannot open " << filename << std::endl;
+            return curve;
+        }
+        double purity, efficiency;
+        while (in >> purity >> efficiency) {
+            curve.cut.push_back(curve.cut.size());
+            curve.purity.push_back(purity);
+            curve.efficiency.push_back(efficiency);
+        }
+        return curve;
+    }
+
+    struct AucRow {
+        double voxelSize;   // cm
+        AucInterval delong;
+        AucInterval bootstrap;
+    };
+
+    // Table read back by AUC_vs_Voxel.C
+    static bool WriteAucTable(const char* filename, const std::vector<AucRow>& rows) {
+        std::ofstream out(filename);
+        if (!out) {
+            std::cerr << "Cannot write " << filename << std::endl;
+            return false;
+        }
+        out << "# voxel[cm] auc delongLow delongHigh delongSigma bootLow bootHigh bootSigma\n";
+        for (const auto& row : rows) {
+            out << row.voxelSize << "\t" << row.delong.auc << "\t"
+                << row.delong.lower << "\t" << row.delong.upper << "\t" << row.delong.sigma << "\t"
+                << row.bootstrap.lower << "\t" << row.bootstrap.upper << "\t" << row.bootstrap.sigma << "\n";
+        }
+        return true;
+    }
+
+    static std::vector<AucRow> ReadAucTable(const char* filename) {
+        std::vector<AucRow> rows;
+        std::ifstream in(filename);
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            std::istringstream fields(line);
+            AucRow row;
+            fields >> row.voxelSize >> row.delong.auc >> row.delong.lower >> row.delong.upper
+                   >> row.delong.sigma >> row.bootstrap.lower >> row.bootstrap.upper
+                   >> row.bootstrap.sigma;
+            row.bootstrap.auc = row.delong.auc;
+            if (fields) rows.push_back(row);
+        }
+        return rows;
+    }
+
+private:
+    // Fraction of the sorted sample below v, ties counted one half
+    static double Placement(const std::vector<double>& sorted, double v) {
+        auto lo = std::lower_bound(sorted.begin(), sorted.end(), v);
+        auto hi = std::upper_bound(lo, sorted.end(), v);
+        return ((lo - sorted.begin()) + 0.5 * (hi - lo)) / sorted.size();
+    }
+
+    // Linear interpolation between order statistics (R type 7)
+    static double Quantile(const std::vector<double>& sorted, double p) {
+        double h = (sorted.size() - 1) * p;
+        std::size_t lo = (std::size_t)std::floor(h);
+        std::size_t hi = std::min(lo + 1, sorted.size() - 1);
+        return sorted[lo] + (h - lo) * (sorted[hi] - sorted[lo]);
+    }
+
+    // Acklam's rational approximation of the standard normal quantile
+    static double NormalQuantile(double p) {
+        static const double a[] = {-3.969683028665376e+01, 2.209460984245205e+02,
+                                   -2.759285104469687e+02, 1.383577518672690e+02,
+                                   -3.066479806614716e+01, 2.506628277459239e+00};
+        static const double b[] = {-5.447609879822406e+01, 1.615858368580409e+02,
+                                   -1.556989798598866e+02, 6.680131188771972e+01,
+                                   -1.328068155288572e+01};
+        static const double c[] = {-7.784894002430293e-03, -3.223964580411365e-01,
+                                   -2.400758277161838e+00, -2.549732539343734e+00,
+                                   4.374664141464968e+00, 2.938163982698783e+00};
+        static const double d[] = {7.784695709041462e-03, 3.224671290700398e-01,
+                                   2.445134137142996e+00, 3.754408661907416e+00};
+        const double pLow = 0.02425;
+        if (p < pLow) {
+            double q = std::sqrt(-2 * std::log(p));
+            return (((((c[0]*q + c[1])*q + c[2])*q + c[3])*q + c[4])*q + c[5]) /
+                   ((((d[0]*q + d[1])*q + d[2])*q + d[3])*q + 1);
+        }
+        if (p > 1 - pLow) return -NormalQuantile(1 - p);
+        double q = p - 0.5, r = q * q;
+        return (((((a[0]*r + a[1])*r + a[2])*r + a[3])*r + a[4])*r + a[5]) * q /
+               (((((b[0]*r + b[1])*r + b[2])*r + b[3])*r + b[4])*r + 1);
+    }
+};
+
+#endif
@@ -0,0 +1,266 @@
+// Synthetic discriminator files for benchmarking without the SliceMethod data.
+//
+// A drum of one of the sizes of fraction_drum_gas.C lies along x, filled with
+// bitumen and holding a spherical gas bubble. Track vertices are drawn in a
+// box around the drum, kept with a probability that depends on the material
+// (scattering is rarer in gas and air), and get a Gaussian discriminator of
+// that material. Write() produces the same content as a discriminator run:
+// the "T" tree (x, y, z, discr) and the histMedianMetric and histBS grids,
+// the latter two voxelized from the tree by TrackVoxelizer. Generation is
+// split into fixed chunks with their own seed, so the tracks only depend on
+// the configuration and not on the number of threads.
+
+#ifndef SYNTHETIC_DRUM_H
+#define SYNTHETIC_DRUM_H
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "TFile.h"
+#include "TH3F.h"
+#include "TTree.h"
+
+#include "ThreadPool.h"
+#include "TrackVoxelizer.h"
+#include "VoxelGrid.h"
+#include "VoxelPyramid.h"
+
+class SyntheticDrum {
+public:
+    enum Size { kSmall, kMedium, kLarge };
+
+    // Volumes (L) of fraction_drum_gas.C
+    struct Shape {
+        const char* name;
+        double drumVolume;
+        double concreteVolume;
+    };
+
+    static const Shape& ShapeOf(Size size) {
+        static const Shape shapes[3] = {
+            {"Small", 26.4207, 18.3170},
+            {"Medium", 87.1320, 63.9105},
+            {"Large", 228.0, 172.5210},
+        };
+        return shapes[size];
+    }
+
+    // "small", "Medium", "LARGE", ...
+    static bool ParseSize(std::string name, Size& size) {
+        for (auto& c : name) c = std::tolower(c);
+        for (int s = kSmall; s <= kLarge; s++) {
+            std::string shape = ShapeOf((Size)s).name;
+            for (auto& c : shape) c = std::tolower(c);
+            if (name == shape) {
+                size = (Size)s;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    enum Material { kAir, kBitumen, kGas };
+
+    struct Config {
+        Size size = kLarge;
+        double voxelSize = 30;                   // mm
+        Long64_t nTracks = 2000000;
+
+        double bubbleVolume = 0.7;               // L, 0 = bitumen only
+        double bubbleCentre[3] = {0, 0, 0};      // mm
+
+        // Length over radius of the drum; 3.14 gives r = 285 mm and
+        // L = 894 mm for the large drum
+        double aspect = 3.14;
+        double margin = 100;                     // air around the drum (mm)
+
+        // Per-material discriminator and vertex acceptance
+        double discrMean[3] = {12.6, 10.9, 11.9};   // air, bitumen, gas
+        double discrSigma[3] = {1.5, 1.5, 1.5};
+        double acceptance[3] = {0.15, 1.0, 0.5};
+
+        int medianBins = 64;
+        uint64_t seed = 4357;
+        unsigned nThreads = 0;
+    };
+
+    // The drum options shared by the command lines, -size, -voxel, -tracks,
+    // -bubble and -at x,y,z. False if the option is not one of them; throws
+    // std::invalid_argument or std::out_of_range on a bad value.
+    static bool ParseOption(const std::string& option, std::string value, Config& config) {
+        if (option == "-size") {
+            if (!ParseSize(value, config.size)) throw std::invalid_argument("unknown drum size");
+        }
+        else if (option == "-voxel") config.voxelSize = std::stod(value);
+        else if (option == "-tracks") config.nTracks = std::stoll(value);
+        else if (option == "-bubble") config.bubbleVolume = std::stod(value);
+        else if (option == "-at") {
+            std::replace(value.begin(), value.end(), ',', ' ');
+            std::istringstream in(value);
+            double centre[3];
+            if (!(in >> centre[0] >> centre[1] >> centre[2])) throw std::invalid_argument("expected x,y,z");
+            std::copy(centre, centre + 3, config.bubbleCentre);
+        }
+        else return false;
+        return true;
+    }
+
+    // Structure of arrays, as the branches are stored
+    struct Tracks {
+        std::vector<float> x, y, z, discr;
+        std::size_t Size() const { return x.size(); }
+    };
+
+    explicit SyntheticDrum(const Config& config) : config_(config) {
+        const double volume = ShapeOf(config.size).drumVolume * 1e6;   // L -> mm^3
+        radius_ = std::cbrt(volume / (M_PI * config.aspect));
+        length_ = config.aspect * radius_;
+        bubbleRadius_ = std::cbrt(config.bubbleVolume * 1e6 * 3 / (4 * M_PI));
+    }
+
+    double Radius() const { return radius_; }
+    double Length() const { return length_; }
+    double BubbleRadius() const { return bubbleRadius_; }
+    const Config& GetConfig() const { return config_; }
+
+    Material At(double x, double y, double z) const {
+        double dx = x - config_.bubbleCentre[0];
+        double dy = y - config_.bubbleCentre[1];
+        double dz = z - config_.bubbleCentre[2];
+        if (bubbleRadius_ > 0 && dx*dx + dy*dy + dz*dz < bubbleRadius_ * bubbleRadius_) return kGas;
+        if (std::fabs(x) < 0.5 * length_ && y*y + z*z < radius_ * radius_) return kBitumen;
+        return kAir;
+    }
+
+    Tracks Generate() const {
+        const Long64_t chunk = 1 << 16;
+        const Long64_t nChunks = (config_.nTracks + chunk - 1) / chunk;
+        Tracks tracks;
+        tracks.x.resize(config_.nTracks);
+        tracks.y.resize(config_.nTracks);
+        tracks.z.resize(config_.nTracks);
+        tracks.discr.resize(config_.nTracks);
+
+        ThreadPool pool(config_.nThreads);
+        std::vector<std::future<void>> pending;
+        for (Long64_t c = 0; c < nChunks; c++) {
+            pending.push_back(pool.Submit([this, c, chunk, &tracks]() {
+                Long64_t first = c * chunk;
+                Long64_t last = std::min(config_.nTracks, first + chunk);
+                FillChunk(config_.seed * 1000003 + c, first, last, tracks);
+            }));
+        }
+        for (auto& future : pending) future.get();
+        return tracks;
+    }
+
+    // Voxel grid of the configured size around the drum and its margin,
+    // an even number of voxels per axis centred on the origin
+    TrackVoxelizer::Config VoxelizerConfig() const {
+        TrackVoxelizer::Config vc;
+        vc.x = CentredAxis(0.5 * length_ + config_.margin);
+        vc.y = CentredAxis(radius_ + config_.margin);
+        vc.z = vc.y;
+        vc.slices = {20, -400, 400};
+        vc.medianBins = config_.medianBins;
+        vc.nThreads = config_.nThreads;
+        return vc;
+    }
+
+    // T tree, then histMedianMetric (median) and histBS (windowed mean)
+    bool Write(const char* filename, const Tracks& tracks) const {
+        if (!WriteTree(filename, tracks)) return false;
+
+        TrackVoxelizer::Result result = TrackVoxelizer(VoxelizerConfig()).Process(filename);
+        if (result.nEntries != (Long64_t)tracks.Size()) {
+            std::cerr << "Cannot read back " << filename << std::endl;
+            return false;
+        }
+        VoxelPyramid::State state = VoxelPyramid::FromResult(std::move(result));
+
+        std::unique_ptr<TFile> file(TFile::Open(filename, "UPDATE"));
+        if (!file || file->IsZombie()) return false;
+        WriteGrid(state.MedianGrid(), "histMedianMetric", file.get());
+        WriteGrid(state.MeanGrid(), "histBS", file.get());
+        file->Close();
+        return true;
+    }
+
+private:
+    Config config_;
+    double radius_, length_, bubbleRadius_;
+
+    TrackVoxelizer::Axis CentredAxis(double halfWidth) const {
+        int n = 2 * (int)std::ceil(halfWidth / config_.voxelSize);
+        return {n, -0.5 * n * config_.voxelSize, 0.5 * n * config_.voxelSize};
+    }
+
+    void FillChunk(uint64_t seed, Long64_t first, Long64_t last, Tracks& tracks) const {
+        std::mt19937_64 rng(seed);
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        std::normal_distribution<double> gaus(0., 1.);
+        const double halfX = 0.5 * length_ + config_.margin;
+        const double halfR = radius_ + config_.margin;
+        for (Long64_t t = first; t < last; t++) {
+            double x, y, z;
+            Material m;
+            do {
+                x = (2 * uniform(rng) - 1) * halfX;
+                y = (2 * uniform(rng) - 1) * halfR;
+                z = (2 * uniform(rng) - 1) * halfR;
+                m = At(x, y, z);
+            } while (uniform(rng) >= config_.acceptance[m]);
+            tracks.x[t] = x;
+            tracks.y[t] = y;
+            tracks.z[t] = z;
+            tracks.discr[t] = config_.discrMean[m] + config_.discrSigma[m] * gaus(rng);
+        }
+    }
+
+    static bool WriteTree(const char* filename, const Tracks& tracks) {
+        std::unique_ptr<TFile> file(TFile::Open(filename, "RECREATE"));
+        if (!file || file->IsZombie()) {
+            std::cerr << "Cannot create " << filename << std::endl;
+            return false;
+        }
+        // Owned by the file
+        TTree* tree = new TTree("T", "synthetic tracks");
+        float x, y, z, discr;
+        tree->Branch("x", &x, "x/F");
+        tree->Branch("y", &y, "y/F");
+        tree->Branch("z", &z, "z/F");
+        tree->Branch("discr", &discr, "discr/F");
+        for (std::size_t t = 0; t < tracks.Size(); t++) {
+            x = tracks.x[t];
+            y = tracks.y[t];
+            z = tracks.z[t];
+            discr = tracks.discr[t];
+            tree->Fill();
+        }
+        tree->Write();
+        file->Close();
+        return true;
+    }
+
+    static void WriteGrid(const VoxelGrid& grid, const char* name, TFile* file) {
+        const auto& g = grid.GetGeometry();
+        TH3F hist(name, name, g.nx, g.xMin, g.xMax, g.ny, g.yMin, g.yMax, g.nz, g.zMin, g.zMax);
+        hist.SetDirectory(0);
+        grid.ToHistogram(&hist);
+        file->cd();
+        hist.Write();
+    }
+};
+
+#endif
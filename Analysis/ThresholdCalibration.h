@@ -0,0 +1,391 @@
+// Median-metric thresholds of the BinaryMap regions, calibrated on
+// bitumen-only reference drums.
+//
+// BinaryMap.C carried 24 thresholds fitted by hand (8 x slabs times the
+// central, upper and lower bands), and medianCut3D.C and Cluster.C their own
+// copy of one of them. ThresholdCalibrator streams any number of reference
+// grids on a thread pool and keeps, for every region, a fixed-size
+// histogram sketch of the median metric of its voxels. Sketches merge by
+// adding bins, so runs can be pooled in any order and memory does not grow
+// with the number of references. The threshold of a region is the quantile
+// of its sketch leaving the requested fraction of bitumen voxels above it;
+// the resulting table is read back by the classification macros. Thresholds
+// only hold for the voxel size they were calibrated at, which the table
+// records and Lookup() checks.
+
+#ifndef THRESHOLD_CALIBRATION_H
+#define THRESHOLD_CALIBRATION_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "GridCache.h"
+#include "ThreadPool.h"
+#include "VoxelGrid.h"
+
+// The regions of BinaryMap.C with the thresholds fitted by hand on STE3
+inline std::vector<CylinderRegion> BinaryMapRegions() {
+    return {
+        {-400, -300, 11.17, true,  false}, // Central regions
+        {-300, -200, 11.19, true,  false},
+        {-200, -100, 11.19, true,  false},
+        {-100,    0, 11.35, true,  false},
+        {   0,  100, 11.35, true,  false},
+        { 100,  200, 11.19, true,  false},
+        { 200,  300, 11.19, true,  false},
+        { 300,  400, 11.15, true,  false},
+
+        {-400, -300, 11.50, false, true},  // Upper regions
+        {-300, -200, 11.56, false, true},
+        {-200, -100, 11.53, false, true},
+        {-100,    0, 11.66, false, true},
+        {   0,  100, 11.66, false, true},
+        { 100,  200, 11.56, false, true},
+        { 200,  300, 11.56, false, true},
+        { 300,  400, 11.54, false, true},
+
+        {-400, -300, 11.25, false, false}, // Lower regions
+        {-300, -200, 11.47, false, false},
+        {-200, -100, 11.35, false, false},
+        {-100,    0, 11.51, false, false},
+        {   0,  100, 11.55, false, false},
+        { 100,  200, 11.41, false, false},
+        { 200,  300, 11.45, false, false},
+        { 300,  400, 11.33, false, false},
+    };
+}
+
+// Table written by CalibrateThresholds.C unless told otherwise
+inline const char* DefaultThresholdTable() {
+    return "/home/mmhaidra/SliceMethod/Calibration/BinaryMap_thresholds.txt";
+}
+
+// Thresholds of the regions and the voxel size (mm) they were calibrated at
+struct ThresholdTable {
+    double voxelSize = 30;                // the hand-fitted ones are for 3 cm voxels
+    std::vector<CylinderRegion> regions = BinaryMapRegions();
+
+    // False, with a warning, if the table was calibrated at another voxel size
+    bool Matches(double dX) const {
+        if (std::fabs(dX - voxelSize) < 1e-6) return true;
+        std::cout << "Warning: thresholds calibrated for " << voxelSize << " mm voxels, not "
+                  << dX << " mm" << std::endl;
+        return false;
+    }
+};
+
+// Fixed-bin quantile sketch over [min, max). Values outside the range are
+// counted in two outer bins and only their extreme values are kept. The
+// quantile error is half a bin width inside the range.
+class QuantileSketch {
+public:
+    QuantileSketch(double min = 7.0, double max = 14.0, int nBins = 4096)
+        : min_(min), max_(max), bins_(nBins + 2, 0) {}
+
+    void Add(double v) {
+        const int n = bins_.size() - 2;
+        int bin;
+        if (v < min_) bin = 0;
+        else if (v >= max_) bin = n + 1;
+        else bin = 1 + std::min(n - 1, (int)((v - min_) / (max_ - min_) * n));
+        bins_[bin]++;
+        count_++;
+        lowest_ = std::min(lowest_, v);
+        highest_ = std::max(highest_, v);
+    }
+
+    // Same binning required
+    bool Merge(const QuantileSketch& other) {
+        if (other.bins_.size() != bins_.size() || other.min_ != min_ || other.max_ != max_) return false;
+        for (std::size_t b = 0; b < bins_.size(); b++) bins_[b] += other.bins_[b];
+        count_ += other.count_;
+        lowest_ = std::min(lowest_, other.lowest_);
+        highest_ = std::max(highest_, other.highest_);
+        return true;
+    }
+
+    uint64_t Count() const { return count_; }
+
+    // Value below which a fraction p of the entries lie
+    double Quantile(double p) const {
+        if (count_ == 0) return NAN;
+        const int n = bins_.size() - 2;
+        const double width = (max_ - min_) / n;
+        const double target = std::min(std::max(p, 0.), 1.) * count_;
+        double below = 0;
+        for (int b = 0; b <= n + 1; b++) {
+            if (bins_[b] == 0 || below + bins_[b] < target) {
+                below += bins_[b];
+                continue;
+            }
+            double low = b == 0 ? lowest_ : min_ + (b - 1) * width;
+            double high = b == n + 1 ? highest_ : min_ + b * width;
+            if (b == 0) high = std::min(high, min_);
+            if (b == n + 1) low = std::max(low, max_);
+            return low + (target - below) / bins_[b] * (high - low);
+        }
+        return highest_;
+    }
+
+    // Plain-text form: header line, then the non-empty bins
+    void Write(std::ostream& out) const {
+        out << min_ << " " << max_ << " " << bins_.size() - 2 << " " << count_ << " "
+            << lowest_ << " " << highest_ << "\n";
+        for (std::size_t b = 0; b < bins_.size(); b++) {
+            if (bins_[b]) out << b << " " << bins_[b] << " ";
+        }
+        out << "\n";
+    }
+
+    bool Read(std::istream& in) {
+        int nBins;
+        std::string line;
+        if (!(in >> min_ >> max_ >> nBins >> count_ >> lowest_ >> highest_)) return false;
+        std::getline(in, line);
+        std::getline(in, line);
+        bins_.assign(nBins + 2, 0);
+        std::istringstream fields(line);
+        std::size_t b;
+        uint64_t c;
+        while (fields >> b >> c) {
+            if (b < bins_.size()) bins_[b] = c;
+        }
+        return true;
+    }
+
+private:
+    double min_, max_;
+    std::vector<uint64_t> bins_;   // underflow, nBins, overflow
+    uint64_t count_ = 0;
+    double lowest_ = INFINITY;
+    double highest_ = -INFINITY;
+};
+
+class ThresholdCalibrator {
+public:
+    struct Config {
+        std::string metric = "histMedianMetric";
+        double radius = 240;                // cylinder of the regions (mm)
+        double voxelSize = 0;               // mm, 0 = the bin width of the references
+        double sketchMin = 7.0;
+        double sketchMax = 14.0;
+        int sketchBins = 4096;
+        unsigned nThreads = 0;
+    };
+
+    explicit ThresholdCalibrator(const Config& config,
+                                 std::vector<CylinderRegion> regions = BinaryMapRegions())
+        : config_(config), regions_(std::move(regions)) {
+        for (std::size_t r = 0; r < regions_.size(); r++) sketches_.push_back(EmptySketch());
+    }
+
+    // Streams the reference grids, at most one per worker in memory.
+    // Returns the number of files that could be read.
+    int AddReferences(const std::vector<std::string>& files) {
+        ThreadPool pool(config_.nThreads);
+        std::vector<std::future<bool>> pending;
+        for (const auto& file : files) {
+            pending.push_back(pool.Submit([this, file]() { return AddReference(file); }));
+        }
+        int nRead = 0;
+        for (auto& future : pending) nRead += future.get();
+        return nRead;
+    }
+
+    // Pools the sketches of another calibration of the same regions
+    bool Merge(const ThresholdCalibrator& other) {
+        if (other.sketches_.size() != sketches_.size()) return false;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!AcceptVoxelSize(other.voxelSize_)) return false;
+        for (std::size_t r = 0; r < sketches_.size(); r++) {
+            if (!sketches_[r].Merge(other.sketches_[r])) return false;
+        }
+        nReferences_ += other.nReferences_;
+        return true;
+    }
+
+    // Regions with the thresholds that leave a fraction falsePositiveRate of
+    // the reference voxels at or above them. Regions without reference
+    // voxels keep their previous threshold.
+    std::vector<CylinderRegion> Thresholds(double falsePositiveRate) const {
+        std::vector<CylinderRegion> result = regions_;
+        for (std::size_t r = 0; r < result.size(); r++) {
+            if (sketches_[r].Count() == 0) continue;
+            result[r].threshold = sketches_[r].Quantile(1. - falsePositiveRate);
+        }
+        return result;
+    }
+
+    const std::vector<QuantileSketch>& Sketches() const { return sketches_; }
+    int NReferences() const { return nReferences_; }
+    double VoxelSize() const { return voxelSize_; }
+
+    // Sketches of all regions, to pool calibrations run separately
+    bool SaveSketches(const char* filename) const {
+        std::ofstream out(filename);
+        if (!out) {
+            std::cerr << "Cannot write " << filename << std::endl;
+            return false;
+        }
+        out << nReferences_ << " " << sketches_.size() << " " << voxelSize_ << "\n";
+        for (const auto& sketch : sketches_) sketch.Write(out);
+        return true;
+    }
+
+    bool LoadSketches(const char* filename) {
+        std::ifstream in(filename);
+        int nRefs;
+        std::size_t nSketches;
+        double voxelSize;
+        if (!(in >> nRefs >> nSketches >> voxelSize) || nSketches != sketches_.size()) {
+            std::cerr << "No sketches for " << sketches_.size() << " regions in " << filename << std::endl;
+            return false;
+        }
+        ThresholdCalibrator loaded(config_, regions_);
+        for (auto& sketch : loaded.sketches_) {
+            if (!sketch.Read(in)) return false;
+        }
+        loaded.nReferences_ = nRefs;
+        loaded.voxelSize_ = voxelSize;
+        if (!Merge(loaded)) {
+            std::cerr << "Cannot pool the sketches of " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // -----------------------------------------------------------------
+    // Threshold table
+
+    static bool WriteTable(const char* filename, const std::vector<CylinderRegion>& regions,
+                           double voxelSize, double falsePositiveRate, int nReferences) {
+        std::ofstream out(filename);
+        if (!out) {
+            std::cerr << "Cannot write " << filename << std::endl;
+            return false;
+        }
+        out << "# " << nReferences << " references, false positive rate " << falsePositiveRate << "\n";
+        out << "voxelSize\t" << voxelSize << "\n";
+        out << "# xMin xMax band threshold\n";
+        for (const auto& region : regions) {
+            out << region.xMin << "\t" << region.xMax << "\t" << BandName(region) << "\t"
+                << region.threshold << "\n";
+        }
+        return true;
+    }
+
+    // Regions of a table, or the hand-fitted BinaryMapRegions() with a
+    // warning if the table cannot be read
+    static ThresholdTable ReadTable(const char* filename) {
+        ThresholdTable table;
+        std::vector<CylinderRegion> regions;
+        double voxelSize = 0;
+        std::ifstream in(filename);
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            std::istringstream fields(line);
+            if (line.compare(0, 9, "voxelSize") == 0) {
+                std::string key;
+                fields >> key >> voxelSize;
+                continue;
+            }
+            CylinderRegion region;
+            std::string band;
+            fields >> region.xMin >> region.xMax >> band >> region.threshold;
+            if (!fields) continue;
+            if (band != "central" && band != "upper" && band != "lower") {
+                std::cerr << "Unknown band " << band << " in threshold table " << filename
+                          << ", using the hand-fitted STE3 thresholds" << std::endl;
+                return table;
+            }
+            region.isCenter = band == "central";
+            region.isUpper = band == "upper";
+            regions.push_back(region);
+        }
+        if (regions.empty() || voxelSize <= 0) {
+            std::cout << "Warning: no threshold table " << filename
+                      << ", using the hand-fitted STE3 thresholds" << std::endl;
+            return table;
+        }
+        table.voxelSize = voxelSize;
+        table.regions = regions;
+        return table;
+    }
+
+    // Threshold of the region [xMin, xMax] in one band for voxels of dX mm,
+    // fallback if the region is absent or the table is for another voxel size
+    static double Lookup(const ThresholdTable& table, double dX, double xMin, double xMax,
+                         bool isCenter, bool isUpper, double fallback) {
+        if (!table.Matches(dX)) return fallback;
+        for (const auto& region : table.regions) {
+            if (region.xMin == xMin && region.xMax == xMax &&
+                region.isCenter == isCenter && (isCenter || region.isUpper == isUpper)) {
+                return region.threshold;
+            }
+        }
+        return fallback;
+    }
+
+private:
+    Config config_;
+    std::vector<CylinderRegion> regions_;
+    std::vector<QuantileSketch> sketches_;
+    int nReferences_ = 0;
+    double voxelSize_ = 0;               // mm, of the references added so far
+    std::mutex mutex_;
+
+    QuantileSketch EmptySketch() const {
+        return QuantileSketch(config_.sketchMin, config_.sketchMax, config_.sketchBins);
+    }
+
+    static const char* BandName(const CylinderRegion& region) {
+        if (region.isCenter) return "central";
+        return region.isUpper ? "upper" : "lower";
+    }
+
+    // All pooled references must share one voxel size. Called under mutex_.
+    bool AcceptVoxelSize(double voxelSize) {
+        if (voxelSize <= 0) return true;     // nothing to pool
+        if (nReferences_ == 0) voxelSize_ = voxelSize;
+        if (std::fabs(voxelSize - voxelSize_) < 1e-6) return true;
+        std::cerr << "Cannot pool " << voxelSize << " mm voxels with " << voxelSize_ << " mm ones" << std::endl;
+        return false;
+    }
+
+    // Fills private sketches from one grid and merges them in
+    bool AddReference(const std::string& file) {
+        std::unique_ptr<VoxelGrid> loaded = GridCache::LoadOwned(file, config_.metric);
+        if (!loaded) return false;
+        VoxelGrid& grid = *loaded;
+        if (config_.voxelSize > 0) grid.SetVoxelSize(config_.voxelSize, config_.voxelSize, config_.voxelSize);
+
+        // Empty voxels have no median
+        VoxelMask filled = grid.NonZero(grid.All());
+        std::vector<QuantileSketch> local;
+        for (const auto& region : regions_) {
+            QuantileSketch sketch = EmptySketch();
+            for (double v : grid.Values(grid.Region(region, config_.radius) & filled)) sketch.Add(v);
+            local.push_back(std::move(sketch));
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!AcceptVoxelSize(grid.GetGeometry().dX)) {
+            std::cerr << "Skipping reference " << file << std::endl;
+            return false;
+        }
+        for (std::size_t r = 0; r < sketches_.size(); r++) sketches_[r].Merge(local[r]);
+        nReferences_++;
+        return true;
+    }
+};
+
+#endif
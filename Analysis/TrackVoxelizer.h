@@ -0,0 +1,429 @@
+// Single-pass voxelizer for the "T" tree of a discriminator file.
+//
+// The old macros (Slices_3D.C, slices_plot_discr_hists*.C) called
+// tree->Draw("discr>>h", cuts) once per voxel or slice, i.e. one full scan of
+// the tree and one formula compilation per cut. Here the x, y, z and discr
+// branches are read once, split into contiguous entry ranges over worker
+// threads. Each worker opens its own TFile (ROOT I/O objects are not shared
+// between threads) and walks its range cluster by cluster: every branch is
+// decoded on its own into a column buffer with the bulk API, one whole basket
+// per call instead of one GetEntry per track, and the accumulators are then
+// filled from the four columns. The partial results
+// are merged at the end, except for the median histograms, which all
+// workers increment in place.
+
+#ifndef TRACK_VOXELIZER_H
+#define TRACK_VOXELIZER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "TBranch.h"
+#include "TBufferFile.h"
+#include "TFile.h"
+#include "TTree.h"
+#include "TLeaf.h"
+#include "TH3D.h"
+#include "TROOT.h"
+
+// Mergeable statistics of the discriminator values that fall in one cell.
+// Only the values inside [discrMin, discrMax] enter the sums, mimicking the
+// SetRangeUser(7, 14) the macros used before taking the mean.
+struct DiscrAccumulator {
+    Long64_t count = 0;      // all tracks in the cell
+    Long64_t nWindow = 0;    // tracks inside the discriminator window
+    double sum = 0;          // windowed sum
+    double sumSq = 0;        // windowed sum of squares
+
+    void Merge(const DiscrAccumulator& other) {
+        count += other.count;
+        nWindow += other.nWindow;
+        sum += other.sum;
+        sumSq += other.sumSq;
+    }
+
+    double Mean() const { return nWindow > 0 ? sum / nWindow : 0.; }
+
+    double RMS() const {
+        if (nWindow == 0) return 0.;
+        double mean = Mean();
+        return std::sqrt(std::max(0., sumSq / nWindow - mean * mean));
+    }
+
+    // Same definition as TH1::GetMeanError for unweighted entries
+    double MeanError() const { return nWindow > 0 ? RMS() / std::sqrt((double)nWindow) : 0.; }
+};
+
+// Median of the values histogrammed in n uniform bins over [min, max],
+// interpolated linearly inside the bin holding the middle entry
+inline double HistogramMedian(const uint32_t* bins, int n, double min, double max) {
+    uint64_t total = 0;
+    for (int b = 0; b < n; b++) total += bins[b];
+    if (total == 0) return 0.;
+    const double half = 0.5 * total;
+    const double width = (max - min) / n;
+    uint64_t below = 0;
+    for (int b = 0; b < n; b++) {
+        if (below + bins[b] >= half) return min + (b + (half - below) / bins[b]) * width;
+        below += bins[b];
+    }
+    return max;
+}
+
+class TrackVoxelizer {
+public:
+    // Uniform binning along one axis, bins are [low, high)
+    struct Axis {
+        int nBins;
+        double min;
+        double max;
+
+        double Width() const { return (max - min) / nBins; }
+
+        // Returns -1 outside of the axis range or for an empty axis
+        int Find(double v) const {
+            if (nBins <= 0 || !(v >= min && v < max)) return -1;
+            int bin = (int)((v - min) / (max - min) * nBins);
+            return bin < nBins ? bin : nBins - 1;
+        }
+    };
+
+    struct Config {
+        // Voxel grid (mm), x.nBins = 0 fills the slices only
+        Axis x{20, -480, 480};
+        Axis y{20, -300, 300};
+        Axis z{20, -300, 300};
+
+        // Slices along one axis (0 = x, 1 = y, 2 = z). A track enters a slice
+        // only if the squares of its two other coordinates sum below sliceCut2,
+        // e.g. (z*z)+(y*y)<(300*300) for x slices.
+        int sliceAxis = 0;
+        Axis slices{20, -400, 400};
+        double sliceCut2 = 300. * 300.;
+
+        // Discriminator window used for the means
+        double discrMin = 7.0;
+        double discrMax = 14.0;
+
+        // Bins of the per-voxel discriminator histogram over the window,
+        // kept for medians; 0 = no histograms
+        int medianBins = 0;
+
+        const char* treeName = "T";
+        unsigned nThreads = 0;              // 0 = all hardware threads
+        Long64_t cacheSize = 64 * 1024 * 1024; // TTreeCache per worker
+    };
+
+    struct Result {
+        enum Status { kOk, kFileError, kNoEntries };
+
+        Config config;
+        Status status = kOk;
+        Long64_t nEntries = 0;
+        std::vector<DiscrAccumulator> voxels;  // index (i*ny + j)*nz + k
+        std::vector<DiscrAccumulator> slices;
+        std::vector<uint32_t> discrHist;       // medianBins per voxel, same order
+
+        bool Ok() const { return status == kOk && nEntries > 0; }
+
+        const char* StatusMessage() const {
+            if (status == kFileError) return "cannot read the tree";
+            if (status == kNoEntries || nEntries <= 0) return "no tracks in the tree or entry range";
+            return "ok";
+        }
+
+        const DiscrAccumulator& Voxel(int i, int j, int k) const {
+            return voxels[((size_t)i * config.y.nBins + j) * config.z.nBins + k];
+        }
+
+        double VoxelMedian(size_t v) const {
+            if (config.medianBins <= 0) return 0.;
+            return HistogramMedian(&discrHist[v * config.medianBins], config.medianBins,
+                                   config.discrMin, config.discrMax);
+        }
+
+        // Mean discriminator map with the binning of the voxel grid
+        std::unique_ptr<TH3D> MeanMap(const char* name, const char* title) const {
+            auto hist = std::make_unique<TH3D>(name, title,
+                config.x.nBins, config.x.min, config.x.max,
+                config.y.nBins, config.y.min, config.y.max,
+                config.z.nBins, config.z.min, config.z.max);
+            hist->SetDirectory(0);
+            for (int i = 0; i < config.x.nBins; i++) {
+                for (int j = 0; j < config.y.nBins; j++) {
+                    for (int k = 0; k < config.z.nBins; k++) {
+                        hist->SetBinContent(i+1, j+1, k+1, Voxel(i, j, k).Mean());
+                        hist->SetBinError(i+1, j+1, k+1, Voxel(i, j, k).MeanError());
+                    }
+                }
+            }
+            return hist;
+        }
+
+        // Slice centres, means and mean errors, ready for a TGraphErrors
+        void SliceMeans(std::vector<double>& centres, std::vector<double>& means,
+                        std::vector<double>& errors) const {
+            int n = config.slices.nBins;
+            centres.resize(n);
+            means.resize(n);
+            errors.resize(n);
+            for (int s = 0; s < n; s++) {
+                centres[s] = config.slices.min + (s + 0.5) * config.slices.Width();
+                means[s] = slices[s].Mean();
+                errors[s] = slices[s].MeanError();
+            }
+        }
+    };
+
+    explicit TrackVoxelizer(const Config& config) : config_(config) {}
+
+    // Slices only, nSlices over [start, finish) along sliceAxis, with the
+    // cut, window and threads of config
+    static Result ProcessSlices(const char* filename, int sliceAxis, double start, double finish,
+                                int nSlices, Config config) {
+        config.x.nBins = 0;
+        config.sliceAxis = sliceAxis;
+        config.slices = {nSlices, start, finish};
+        config.medianBins = 0;
+        return TrackVoxelizer(config).Process(filename);
+    }
+
+    // Entries [firstEntry, lastEntry) of the tree, lastEntry < 0 = up to the end
+    Result Process(const char* filename, Long64_t firstEntry = 0, Long64_t lastEntry = -1) const {
+        Result result;
+        result.config = config_;
+        Allocate(result);
+
+        Long64_t total = CountEntries(filename);
+        if (total < 0) {
+            result.status = Result::kFileError;
+            return result;
+        }
+        if (total == 0) {
+            result.status = Result::kNoEntries;
+            return result;
+        }
+        if (lastEntry < 0 || lastEntry > total) lastEntry = total;
+        firstEntry = std::max<Long64_t>(firstEntry, 0);
+        Long64_t nEntries = lastEntry - firstEntry;
+        if (nEntries <= 0) {
+            result.status = Result::kNoEntries;
+            return result;
+        }
+        result.nEntries = nEntries;
+
+        unsigned nThreads = config_.nThreads ? config_.nThreads
+                                             : std::max(1u, std::thread::hardware_concurrency());
+        nThreads = (unsigned)std::min<Long64_t>(nThreads, nEntries);
+
+        // Per-worker accumulators, merged once all threads are done. The
+        // median histograms are medianBins counters per voxel (221 MB for
+        // VoxelPyramid::FineConfig), too large for one copy per worker, so
+        // all workers increment a single shared set.
+        std::vector<Result> partial(nThreads);
+        std::vector<char> failed(nThreads, 0);
+        std::unique_ptr<std::atomic<uint32_t>[]> discrHist(
+            new std::atomic<uint32_t>[result.discrHist.size()]());
+        std::vector<std::thread> workers;
+        ROOT::EnableThreadSafety();
+
+        Long64_t chunk = (nEntries + nThreads - 1) / nThreads;
+        for (unsigned t = 0; t < nThreads; t++) {
+            Long64_t first = firstEntry + t * chunk;
+            Long64_t last = std::min(lastEntry, first + chunk);
+            workers.emplace_back([this, filename, first, last, &partial, &discrHist, &failed, t]() {
+                Allocate(partial[t], false);
+                failed[t] = !FillRange(filename, first, last, partial[t], discrHist.get());
+            });
+        }
+        for (auto& worker : workers) worker.join();
+
+        // A worker that could not read its range leaves a hole in the sums
+        for (unsigned t = 0; t < nThreads; t++) {
+            if (!failed[t]) continue;
+            Long64_t first = firstEntry + t * chunk;
+            std::cerr << "Worker " << t << " could not read entries " << first << " to "
+                      << std::min(lastEntry, first + chunk) << " of " << filename << std::endl;
+            result.status = Result::kFileError;
+        }
+
+        for (const auto& part : partial) {
+            for (size_t v = 0; v < result.voxels.size(); v++) result.voxels[v].Merge(part.voxels[v]);
+            for (size_t s = 0; s < result.slices.size(); s++) result.slices[s].Merge(part.slices[s]);
+        }
+        for (size_t b = 0; b < result.discrHist.size(); b++) {
+            result.discrHist[b] = discrHist[b].load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+private:
+    Config config_;
+
+    size_t NVoxels() const {
+        return (size_t)config_.x.nBins * config_.y.nBins * config_.z.nBins;
+    }
+
+    // The median histograms are left out of the worker partials
+    void Allocate(Result& result, bool withHistograms = true) const {
+        result.voxels.resize(NVoxels());
+        result.slices.resize(config_.slices.nBins);
+        if (withHistograms) result.discrHist.assign(NVoxels() * std::max(config_.medianBins, 0), 0);
+    }
+
+    Long64_t CountEntries(const char* filename) const {
+        std::unique_ptr<TFile> file(TFile::Open(filename, "READ"));
+        if (!file || file->IsZombie()) {
+            std::cerr << "Error opening input file: " << filename << std::endl;
+            return -1;
+        }
+        auto tree = (TTree*)file->Get(config_.treeName);
+        if (!tree) {
+            std::cerr << "No tree " << config_.treeName << " in " << filename << std::endl;
+            return -1;
+        }
+        return tree->GetEntries();
+    }
+
+    // One branch read on its own into a contiguous buffer. Float and double
+    // branches are both accepted.
+    struct Column {
+        TBranch* branch = nullptr;
+        bool isDouble = false;
+        bool bulk = true;          // off for the branches the bulk API rejects
+        float f = 0;
+        double d = 0;
+        std::vector<double> values;
+        TBufferFile buffer{TBuffer::kWrite, 32 * 1024};
+
+        bool Bind(TTree* tree, const char* name) {
+            TLeaf* leaf = tree->GetLeaf(name);
+            branch = tree->GetBranch(name);
+            if (!leaf || !branch) return false;
+            std::string type = leaf->GetTypeName();
+            if (type == "Double_t") isDouble = true;
+            else if (type != "Float_t") return false;
+            tree->SetBranchAddress(name, isDouble ? (void*)&d : (void*)&f);
+            return true;
+        }
+
+        // Entries [first, last). GetBulkEntries() decodes the whole basket
+        // holding an entry into buffer, in host byte order, and returns its
+        // number of entries; the basket starts at its first entry, not at the
+        // one asked for. Entry by entry if the branch is not bulk readable.
+        void Read(Long64_t first, Long64_t last) {
+            values.resize(last - first);
+            Long64_t entry = first;
+            while (entry < last) {
+                Int_t n = bulk ? branch->GetBulkRead().GetBulkEntries(entry, buffer) : -1;
+                Long64_t basketStart = n > 0 ? branch->GetBasketEntry()[branch->GetReadBasket()] : 0;
+                if (n <= 0 || entry < basketStart || entry >= basketStart + n) {
+                    bulk = false;
+                    branch->GetEntry(entry);
+                    values[entry - first] = isDouble ? d : f;
+                    entry++;
+                    continue;
+                }
+                Long64_t end = std::min(last, basketStart + n);
+                if (isDouble) {
+                    const double* basket = reinterpret_cast<const double*>(buffer.GetCurrent());
+                    for (; entry < end; entry++) values[entry - first] = basket[entry - basketStart];
+                }
+                else {
+                    const float* basket = reinterpret_cast<const float*>(buffer.GetCurrent());
+                    for (; entry < end; entry++) values[entry - first] = basket[entry - basketStart];
+                }
+            }
+        }
+    };
+
+    // Reads entries [first, last) of the four columns and fills the
+    // accumulators of out and the shared median histograms; false if the
+    // file, the tree or a branch cannot be read
+    bool FillRange(const char* filename, Long64_t first, Long64_t last, Result& out,
+                   std::atomic<uint32_t>* discrHist) const {
+        std::unique_ptr<TFile> file(TFile::Open(filename, "READ"));
+        if (!file || file->IsZombie()) return false;
+        auto tree = (TTree*)file->Get(config_.treeName);
+        if (!tree) return false;
+
+        // Only the needed branches are read, prefetched in clusters by the cache
+        const char* names[4] = {"x", "y", "z", "discr"};
+        tree->SetBranchStatus("*", 0);
+        tree->SetCacheSize(config_.cacheSize);
+        for (auto name : names) {
+            tree->SetBranchStatus(name, 1);
+            tree->AddBranchToCache(name, kTRUE);
+        }
+        tree->SetCacheEntryRange(first, last);
+
+        Column columns[4];
+        for (int c = 0; c < 4; c++) {
+            if (!columns[c].Bind(tree, names[c])) {
+                std::cerr << "Missing float/double branch " << names[c] << " in " << filename << std::endl;
+                return false;
+            }
+        }
+
+        auto clusters = tree->GetClusterIterator(first);
+        Long64_t clusterStart;
+        while ((clusterStart = clusters()) < last) {
+            Long64_t begin = std::max(clusterStart, first);
+            Long64_t end = std::min(clusters.GetNextEntry(), last);
+            if (end <= begin) continue;
+            for (auto& column : columns) column.Read(begin, end);
+            FillColumns(columns[0].values.data(), columns[1].values.data(), columns[2].values.data(),
+                        columns[3].values.data(), end - begin, out, discrHist);
+        }
+        return true;
+    }
+
+    void FillColumns(const double* x, const double* y, const double* z, const double* discrs,
+                     Long64_t n, Result& out, std::atomic<uint32_t>* discrHist) const {
+        const int ny = config_.y.nBins;
+        const int nz = config_.z.nBins;
+        const int nHist = config_.medianBins;
+        const double histScale = nHist / (config_.discrMax - config_.discrMin);
+        for (Long64_t e = 0; e < n; e++) {
+            double pos[3] = {x[e], y[e], z[e]};
+            double discr = discrs[e];
+            bool inWindow = discr >= config_.discrMin && discr <= config_.discrMax;
+
+            int i = config_.x.Find(pos[0]);
+            int j = config_.y.Find(pos[1]);
+            int k = config_.z.Find(pos[2]);
+            if (i >= 0 && j >= 0 && k >= 0) {
+                size_t v = ((size_t)i * ny + j) * nz + k;
+                Add(out.voxels[v], discr, inWindow);
+                if (nHist > 0 && inWindow) {
+                    int b = std::min(nHist - 1, (int)((discr - config_.discrMin) * histScale));
+                    discrHist[v * nHist + b].fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            int s = config_.slices.Find(pos[config_.sliceAxis]);
+            if (s >= 0) {
+                double a = pos[(config_.sliceAxis + 1) % 3];
+                double b = pos[(config_.sliceAxis + 2) % 3];
+                if (a*a + b*b < config_.sliceCut2) Add(out.slices[s], discr, inWindow);
+            }
+        }
+    }
+
+    static void Add(DiscrAccumulator& acc, double discr, bool inWindow) {
+        acc.count++;
+        if (!inWindow) return;
+        acc.nWindow++;
+        acc.sum += discr;
+        acc.sumSq += discr * discr;
+    }
+};
+
+#endif
@@ -0,0 +1,465 @@
+// Flat voxel grid shared by the analysis macros.
+//
+// The macros used to walk a TH3F with triple FindBin loops, calling the
+// virtual GetBinContent(i,j,k) and recomputing the cylinder and z-band cuts
+// for every voxel. VoxelGrid copies the histogram once into a contiguous,
+// 64-byte aligned float array (x slowest, z fastest) and keeps the geometry
+// explicit. Regions are precomputed once as bit masks (VoxelMask) and reused;
+// the kernels below only visit the voxels selected by a mask and are written
+// as plain loops over contiguous floats so the compiler can vectorize them.
+//
+// Coordinates follow the convention of the original macros:
+//   x = (bin - NbinsX/2) * dX
+// with bin the ROOT bin number (1..NbinsX) and NbinsX/2 an integer division.
+
+#ifndef VOXEL_GRID_H
+#define VOXEL_GRID_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "TH1.h"
+#include "TH3.h"
+#include "TAxis.h"
+
+// Allocator giving cache-line (and AVX-512) aligned storage
+template <typename T, std::size_t Alignment = 64>
+struct AlignedAllocator {
+    typedef T value_type;
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    template <typename U>
+    struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+    T* allocate(std::size_t n) {
+        std::size_t bytes = (n * sizeof(T) + Alignment - 1) / Alignment * Alignment;
+        void* ptr = std::aligned_alloc(Alignment, bytes ? bytes : Alignment);
+        if (!ptr) throw std::bad_alloc();
+        return static_cast<T*>(ptr);
+    }
+    void deallocate(T* ptr, std::size_t) { std::free(ptr); }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+typedef std::vector<float, AlignedAllocator<float>> AlignedFloats;
+
+// Bit-packed selection of voxels, one bit per voxel in grid order
+class VoxelMask {
+public:
+    VoxelMask() : size_(0) {}
+    explicit VoxelMask(std::size_t size, bool value = false)
+        : size_(size), words_((size + 63) / 64, value ? ~0ULL : 0ULL) {
+        ClearTail();
+    }
+
+    std::size_t Size() const { return size_; }
+    std::size_t NWords() const { return words_.size(); }
+    const uint64_t* Words() const { return words_.data(); }
+    uint64_t* Words() { return words_.data(); }
+
+    bool Test(std::size_t v) const { return (words_[v >> 6] >> (v & 63)) & 1ULL; }
+    void Set(std::size_t v) { words_[v >> 6] |= 1ULL << (v & 63); }
+    void Reset(std::size_t v) { words_[v >> 6] &= ~(1ULL << (v & 63)); }
+
+    std::size_t Count() const {
+        std::size_t n = 0;
+        for (uint64_t w : words_) n += __builtin_popcountll(w);
+        return n;
+    }
+
+    VoxelMask& operator&=(const VoxelMask& other) {
+        for (std::size_t w = 0; w < words_.size(); w++) words_[w] &= other.words_[w];
+        return *this;
+    }
+    VoxelMask& operator|=(const VoxelMask& other) {
+        for (std::size_t w = 0; w < words_.size(); w++) words_[w] |= other.words_[w];
+        return *this;
+    }
+    VoxelMask operator~() const {
+        VoxelMask result(*this);
+        for (auto& w : result.words_) w = ~w;
+        result.ClearTail();
+        return result;
+    }
+    friend VoxelMask operator&(VoxelMask a, const VoxelMask& b) { return a &= b; }
+    friend VoxelMask operator|(VoxelMask a, const VoxelMask& b) { return a |= b; }
+
+    // Calls f(v) for every selected voxel index, word by word
+    template <typename F>
+    void ForEach(F f) const {
+        for (std::size_t w = 0; w < words_.size(); w++) {
+            uint64_t bits = words_[w];
+            while (bits) {
+                int b = __builtin_ctzll(bits);
+                f((w << 6) + b);
+                bits &= bits - 1;
+            }
+        }
+    }
+
+private:
+    std::size_t size_;
+    std::vector<uint64_t> words_;
+
+    void ClearTail() {
+        if (size_ & 63) words_.back() &= (1ULL << (size_ & 63)) - 1;
+    }
+};
+
+// One of the BinaryMap regions: an x slab of the drum inside the 240 mm
+// cylinder. Central regions skip -100 < z <= 100, upper regions keep
+// z > 100 and lower regions keep z < -100.
+struct CylinderRegion {
+    double xMin;
+    double xMax;
+    double threshold;
+    bool isCenter;
+    bool isUpper;
+};
+
+class VoxelGrid {
+public:
+    struct Geometry {
+        int nx = 0, ny = 0, nz = 0;
+        double dX = 0, dY = 0, dZ = 0;                   // voxel size (mm)
+        double centreX = 0, centreY = 0, centreZ = 0;    // centre bin offsets
+        double xMin = 0, yMin = 0, zMin = 0;             // histogram low edges
+        double xMax = 0, yMax = 0, zMax = 0;             // histogram high edges
+
+        std::size_t NVoxels() const { return (std::size_t)nx * ny * nz; }
+
+        // The x slabs [iBegin, iEnd) alone: the x axis shrinks to them and
+        // the centre offset follows, so that voxel i of the sub-grid keeps
+        // the coordinates and bin edges of voxel iBegin + i of the full grid
+        Geometry XSlabs(int iBegin, int iEnd) const {
+            Geometry g = *this;
+            const double width = (xMax - xMin) / nx;
+            g.nx = iEnd - iBegin;
+            g.xMin = xMin + iBegin * width;
+            g.xMax = xMin + iEnd * width;
+            g.centreX = centreX - iBegin;
+            return g;
+        }
+    };
+
+    VoxelGrid() {}
+
+    explicit VoxelGrid(const Geometry& geometry)
+        : geometry_(geometry), data_(geometry.NVoxels(), 0.f) {}
+
+    // Copies the in-range bins of a TH3. The voxel size is taken from the
+    // histogram unless given explicitly, as the macros hardcoded dX = 30.
+    static VoxelGrid FromHistogram(const TH3* hist, double dX = 0, double dY = 0, double dZ = 0) {
+        Geometry g = HistogramGeometry(hist, dX, dY, dZ);
+        return FromHistogram(hist, g, 0, g.nx);
+    }
+
+    // Only the x slabs [iBegin, iEnd) of a histogram of geometry g, see
+    // Geometry::XSlabs
+    static VoxelGrid FromHistogram(const TH3* hist, const Geometry& g, int iBegin, int iEnd) {
+        VoxelGrid grid(g.XSlabs(iBegin, iEnd));
+        for (int i = 0; i < grid.geometry_.nx; i++) {
+            for (int j = 0; j < g.ny; j++) {
+                float* row = &grid.data_[grid.Index(i, j, 0)];
+                for (int k = 0; k < g.nz; k++) {
+                    row[k] = hist->GetBinContent(iBegin + i + 1, j+1, k+1);
+                }
+            }
+        }
+        return grid;
+    }
+
+    // Geometry of FromHistogram
+    static Geometry HistogramGeometry(const TH3* hist, double dX = 0, double dY = 0, double dZ = 0) {
+        Geometry g;
+        g.nx = hist->GetNbinsX();
+        g.ny = hist->GetNbinsY();
+        g.nz = hist->GetNbinsZ();
+        g.xMin = hist->GetXaxis()->GetXmin();
+        g.xMax = hist->GetXaxis()->GetXmax();
+        g.yMin = hist->GetYaxis()->GetXmin();
+        g.yMax = hist->GetYaxis()->GetXmax();
+        g.zMin = hist->GetZaxis()->GetXmin();
+        g.zMax = hist->GetZaxis()->GetXmax();
+        g.dX = dX > 0 ? dX : (g.xMax - g.xMin) / g.nx;
+        g.dY = dY > 0 ? dY : (g.yMax - g.yMin) / g.ny;
+        g.dZ = dZ > 0 ? dZ : (g.zMax - g.zMin) / g.nz;
+        g.centreX = g.nx / 2;
+        g.centreY = g.ny / 2;
+        g.centreZ = g.nz / 2;
+        return g;
+    }
+
+    // Writes the grid back into a histogram with the same binning
+    void ToHistogram(TH3* hist) const {
+        hist->Reset();
+        for (int i = 0; i < geometry_.nx; i++) {
+            for (int j = 0; j < geometry_.ny; j++) {
+                const float* row = &data_[Index(i, j, 0)];
+                for (int k = 0; k < geometry_.nz; k++) {
+                    if (row[k] != 0.f) hist->SetBinContent(i+1, j+1, k+1, row[k]);
+                }
+            }
+        }
+    }
+
+    const Geometry& GetGeometry() const { return geometry_; }
+
+    // Overrides the voxel size used for the macro coordinates, for the
+    // macros that passed dX = 30 to FromHistogram
+    void SetVoxelSize(double dX, double dY, double dZ) {
+        geometry_.dX = dX;
+        geometry_.dY = dY;
+        geometry_.dZ = dZ;
+    }
+
+    std::size_t Size() const { return data_.size(); }
+    const float* Data() const { return data_.data(); }
+    float* Data() { return data_.data(); }
+
+    // Zero-based voxel indices, x slowest
+    std::size_t Index(int i, int j, int k) const {
+        return ((std::size_t)i * geometry_.ny + j) * geometry_.nz + k;
+    }
+    void Unravel(std::size_t idx, int& i, int& j, int& k) const {
+        k = idx % geometry_.nz;
+        j = (idx / geometry_.nz) % geometry_.ny;
+        i = idx / ((std::size_t)geometry_.ny * geometry_.nz);
+    }
+    float At(int i, int j, int k) const { return data_[Index(i, j, k)]; }
+
+    // Same as GetBinContent: zero outside the histogram range
+    float AtOrZero(int i, int j, int k) const {
+        if (i < 0 || j < 0 || k < 0 ||
+            i >= geometry_.nx || j >= geometry_.ny || k >= geometry_.nz) return 0.f;
+        return At(i, j, k);
+    }
+
+    // Macro coordinates of a zero-based voxel index
+    double X(int i) const { return (i + 1 - geometry_.centreX) * geometry_.dX; }
+    double Y(int j) const { return (j + 1 - geometry_.centreY) * geometry_.dY; }
+    double Z(int k) const { return (k + 1 - geometry_.centreZ) * geometry_.dZ; }
+
+    // ---------------------------------------------------------------------
+    // Masks
+
+    VoxelMask All() const { return VoxelMask(Size(), true); }
+
+    // Voxels whose macro coordinates satisfy pred(x, y, z)
+    template <typename Pred>
+    VoxelMask Select(Pred pred) const {
+        VoxelMask mask(Size());
+        for (int i = 0; i < geometry_.nx; i++) {
+            double x = X(i);
+            for (int j = 0; j < geometry_.ny; j++) {
+                double y = Y(j);
+                for (int k = 0; k < geometry_.nz; k++) {
+                    if (pred(x, y, Z(k))) mask.Set(Index(i, j, k));
+                }
+            }
+        }
+        return mask;
+    }
+
+    // The loop bounds of the macros: FindBin(lo) <= bin < FindBin(hi) on each axis
+    VoxelMask BinBox(double xLo, double xHi, double yLo, double yHi,
+                     double zLo, double zHi) const {
+        int iLo = FindBin(xLo, geometry_.xMin, geometry_.xMax, geometry_.nx) - 1;
+        int iHi = FindBin(xHi, geometry_.xMin, geometry_.xMax, geometry_.nx) - 1;
+        int jLo = FindBin(yLo, geometry_.yMin, geometry_.yMax, geometry_.ny) - 1;
+        int jHi = FindBin(yHi, geometry_.yMin, geometry_.yMax, geometry_.ny) - 1;
+        int kLo = FindBin(zLo, geometry_.zMin, geometry_.zMax, geometry_.nz) - 1;
+        int kHi = FindBin(zHi, geometry_.zMin, geometry_.zMax, geometry_.nz) - 1;
+
+        VoxelMask mask(Size());
+        for (int i = std::max(iLo, 0); i < std::min(iHi, geometry_.nx); i++) {
+            for (int j = std::max(jLo, 0); j < std::min(jHi, geometry_.ny); j++) {
+                for (int k = std::max(kLo, 0); k < std::min(kHi, geometry_.nz); k++) {
+                    mask.Set(Index(i, j, k));
+                }
+            }
+        }
+        return mask;
+    }
+
+    // y^2 + z^2 < radius^2
+    VoxelMask Cylinder(double radius) const {
+        double r2 = radius * radius;
+        return Select([r2](double, double y, double z) { return y*y + z*z < r2; });
+    }
+
+    // xMin < x <= xMax
+    VoxelMask XSlab(double xMin, double xMax) const {
+        return Select([=](double x, double, double) { return x > xMin && x <= xMax; });
+    }
+
+    // Everything except the two z bands (inner, outer] on both sides of the
+    // drum axis, by default the -240..-100 and 100..240 bands
+    VoxelMask ZBandExclusion(double inner = 100, double outer = 240) const {
+        return Select([=](double, double, double z) {
+            return !((z > -outer && z <= -inner) || (z > inner && z <= outer));
+        });
+    }
+
+    // One BinaryMap region, see CylinderRegion
+    VoxelMask Region(const CylinderRegion& region, double radius = 240) const {
+        double r2 = radius * radius;
+        VoxelMask mask = Select([&](double, double y, double z) {
+            if (y*y + z*z >= r2) return false;
+            if (region.isCenter) return !(z > -100 && z <= 100);
+            if (region.isUpper) return z > 100;
+            return z < -100;
+        });
+        return mask & BinBox(region.xMin, region.xMax, -1000, 1000, -500, 500);
+    }
+
+    // ---------------------------------------------------------------------
+    // Kernels over the voxels selected by a mask
+
+    // Sum of the selected voxel values
+    double Integral(const VoxelMask& mask) const {
+        double total = 0;
+        const float* v = data_.data();
+        for (std::size_t w = 0; w < mask.NWords(); w++, v += 64) {
+            uint64_t bits = mask.Words()[w];
+            if (!bits) continue;
+            std::size_t n = std::min<std::size_t>(64, Size() - (w << 6));
+            double partial = 0;
+            if (bits == ~0ULL) {
+                for (std::size_t b = 0; b < n; b++) partial += v[b];
+            } else {
+                for (std::size_t b = 0; b < n; b++) partial += ((bits >> b) & 1ULL) ? v[b] : 0.;
+            }
+            total += partial;
+        }
+        return total;
+    }
+
+    // Selected voxels with value >= threshold
+    VoxelMask Threshold(const VoxelMask& mask, float threshold) const {
+        VoxelMask result(Size());
+        const float* v = data_.data();
+        for (std::size_t w = 0; w < mask.NWords(); w++, v += 64) {
+            uint64_t bits = mask.Words()[w];
+            if (!bits) continue;
+            std::size_t n = std::min<std::size_t>(64, Size() - (w << 6));
+            uint64_t above = 0;
+            for (std::size_t b = 0; b < n; b++) above |= (uint64_t)(v[b] >= threshold) << b;
+            result.Words()[w] = above & bits;
+        }
+        return result;
+    }
+
+    // Selected voxels with a non-zero value
+    VoxelMask NonZero(const VoxelMask& mask) const {
+        VoxelMask result(Size());
+        const float* v = data_.data();
+        for (std::size_t w = 0; w < mask.NWords(); w++, v += 64) {
+            uint64_t bits = mask.Words()[w];
+            if (!bits) continue;
+            std::size_t n = std::min<std::size_t>(64, Size() - (w << 6));
+            uint64_t filled = 0;
+            for (std::size_t b = 0; b < n; b++) filled |= (uint64_t)(v[b] != 0.f) << b;
+            result.Words()[w] = filled & bits;
+        }
+        return result;
+    }
+
+    std::size_t CountAbove(const VoxelMask& mask, float threshold) const {
+        return Threshold(mask, threshold).Count();
+    }
+
+    // The selected values in grid order, e.g. as ROC scores
+    std::vector<double> Values(const VoxelMask& mask) const {
+        std::vector<double> values;
+        values.reserve(mask.Count());
+        const float* v = data_.data();
+        mask.ForEach([&](std::size_t idx) { values.push_back(v[idx]); });
+        return values;
+    }
+
+    // Fixed-bin histogram of the selected values. Bin 0 and nBins+1 hold
+    // the underflow and overflow, as in a TH1.
+    std::vector<double> Histogram(const VoxelMask& mask, int nBins, double min, double max) const {
+        std::vector<double> counts(nBins + 2, 0.);
+        const double scale = nBins / (max - min);
+        const float* v = data_.data();
+        mask.ForEach([&](std::size_t idx) {
+            double value = v[idx];
+            int bin;
+            if (value < min) bin = 0;
+            else if (value >= max) bin = nBins + 1;
+            else bin = 1 + std::min(nBins - 1, (int)((value - min) * scale));
+            counts[bin] += 1.;
+        });
+        return counts;
+    }
+
+    // Same, added to an existing TH1 with uniform binning. The bin errors
+    // grow as for unit-weight Fill calls (Sumw2 is switched on).
+    void FillHistogram(const VoxelMask& mask, TH1* hist) const {
+        const TAxis* axis = hist->GetXaxis();
+        auto counts = Histogram(mask, axis->GetNbins(), axis->GetXmin(), axis->GetXmax());
+        double entries = hist->GetEntries();
+        for (std::size_t bin = 0; bin < counts.size(); bin++) {
+            if (counts[bin] == 0.) continue;
+            double error = hist->GetBinError(bin);
+            hist->SetBinContent(bin, hist->GetBinContent(bin) + counts[bin]);
+            hist->SetBinError(bin, std::sqrt(error * error + counts[bin]));
+            entries += counts[bin];
+        }
+        hist->SetEntries(entries);
+    }
+
+    // a - b on the selected voxels, skipping voxels that are empty in either
+    // grid as the Detection_* macros do. Other voxels are left at zero.
+    static VoxelGrid Difference(const VoxelGrid& a, const VoxelGrid& b, const VoxelMask& mask) {
+        VoxelGrid result(a.geometry_);
+        const float* va = a.Data();
+        const float* vb = b.Data();
+        float* out = result.Data();
+        for (std::size_t w = 0; w < mask.NWords(); w++) {
+            uint64_t bits = mask.Words()[w];
+            if (!bits) continue;
+            std::size_t first = w << 6;
+            std::size_t n = std::min<std::size_t>(64, a.Size() - first);
+            for (std::size_t e = 0; e < n; e++) {
+                float x = va[first + e], y = vb[first + e];
+                bool keep = ((bits >> e) & 1ULL) && x != 0.f && y != 0.f;
+                out[first + e] = keep ? x - y : 0.f;
+            }
+        }
+        return result;
+    }
+
+    // Sets value on the selected voxels
+    void Assign(const VoxelMask& mask, float value) {
+        float* v = data_.data();
+        mask.ForEach([&](std::size_t idx) { v[idx] = value; });
+    }
+
+private:
+    Geometry geometry_;
+    AlignedFloats data_;
+
+    // TAxis::FindBin for a uniform axis: 0 underflow, n+1 overflow
+    static int FindBin(double v, double min, double max, int n) {
+        if (v < min) return 0;
+        if (v >= max) return n + 1;
+        return 1 + std::min(n - 1, (int)((v - min) / (max - min) * n));
+    }
+};
+
+#endif
@@ -0,0 +1,534 @@
+// Compact binary voxel maps, read through a read-only memory mapping.
+//
+// Opening a .discriminator.root file deserializes every TH3 it contains,
+// even when a macro only looks at one x slab of one metric. A .voxmap file
+// holds the metrics of one drum as separate float planes in VoxelGrid order
+// (x slowest), each plane starting on a page boundary, after a header with
+// the grid geometry. An x range query therefore only touches the pages of
+// the slabs it needs, and uncompressed slabs are read in place without a
+// copy. Planes may instead be stored zlib-compressed, one chunk per x slab.
+//
+// Only the in-range bin contents are kept, as floats. Under/overflow bins
+// and bin errors are dropped, and TH3D metrics are narrowed to float (the
+// entry is flagged). The title and the number of entries of the original
+// histogram are stored, so Histogram() restores them.
+//
+// Layout (native byte order):
+//   Header                    magic, version, metric count, geometry
+//   MetricEntry[nMetrics]     name, title, compression, flags, offset and
+//                             size of the plane, histogram entries
+//   planes                    raw: nx*ny*nz floats, page aligned
+//                             zlib: nx (offset, size) pairs, then the chunks
+
+#ifndef VOXEL_MAP_FILE_H
+#define VOXEL_MAP_FILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+#include "TFile.h"
+#include "TH3.h"
+
+#include "VoxelGrid.h"
+
+class VoxelMapFile {
+public:
+    enum Compression : uint32_t { kRaw = 0, kZlib = 1 };
+    enum Flags : uint32_t { kNarrowed = 1 };   // stored from a TH3D
+
+    static const uint32_t kVersion = 2;
+
+    ~VoxelMapFile() {
+        if (base_) munmap(const_cast<uint8_t*>(base_), size_);
+    }
+
+    VoxelMapFile(const VoxelMapFile&) = delete;
+    VoxelMapFile& operator=(const VoxelMapFile&) = delete;
+
+    // Maps filename read-only, nullptr if it is missing or not a voxel map
+    static std::unique_ptr<VoxelMapFile> Open(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Cannot open voxel map " << filename << std::endl;
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (std::size_t)st.st_size < sizeof(Header)) {
+            std::cerr << "Truncated voxel map " << filename << std::endl;
+            close(fd);
+            return nullptr;
+        }
+        void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);  // the mapping keeps the file referenced
+        if (base == MAP_FAILED) {
+            std::cerr << "Cannot map voxel map " << filename << std::endl;
+            return nullptr;
+        }
+        // Queries jump to the slabs they need, do not read ahead
+        madvise(base, st.st_size, MADV_RANDOM);
+
+        std::unique_ptr<VoxelMapFile> map(new VoxelMapFile((const uint8_t*)base, st.st_size));
+        if (!map->ParseHeader()) {
+            std::cerr << "Corrupt or not a version " << kVersion << " voxel map: " << filename << std::endl;
+            return nullptr;
+        }
+        return map;
+    }
+
+    static bool Exists(const std::string& filename) {
+        return access(filename.c_str(), R_OK) == 0;
+    }
+
+    // Voxel map next to a discriminator file: x.discriminator.root -> x.discriminator.voxmap
+    static std::string PathFor(const std::string& rootFile) {
+        const std::string ext = ".root";
+        if (rootFile.size() > ext.size() &&
+            rootFile.compare(rootFile.size() - ext.size(), ext.size(), ext) == 0) {
+            return rootFile.substr(0, rootFile.size() - ext.size()) + ".voxmap";
+        }
+        return rootFile + ".voxmap";
+    }
+
+    const VoxelGrid::Geometry& GetGeometry() const { return geometry_; }
+
+    std::vector<std::string> Metrics() const {
+        std::vector<std::string> names;
+        for (const auto& entry : entries_) names.push_back(entry->name);
+        return names;
+    }
+
+    bool Has(const std::string& metric) const { return Find(metric) != nullptr; }
+
+    // Zero-copy view of x slab i (ny*nz floats), nullptr if the metric is
+    // compressed or missing
+    const float* Slab(const std::string& metric, int i) const {
+        const MetricEntry* entry = Find(metric);
+        if (!entry || entry->compression != kRaw || i < 0 || i >= geometry_.nx) return nullptr;
+        return (const float*)(base_ + entry->offset) + (std::size_t)i * SlabSize();
+    }
+
+    // Copies (or inflates) x slab i into out, ny*nz floats
+    bool ReadSlab(const std::string& metric, int i, float* out) const {
+        const MetricEntry* entry = Find(metric);
+        if (!entry || i < 0 || i >= geometry_.nx) return false;
+        const std::size_t bytes = SlabSize() * sizeof(float);
+        if (entry->compression == kRaw) {
+            std::memcpy(out, Slab(metric, i), bytes);
+            return true;
+        }
+        const uint64_t* table = (const uint64_t*)(base_ + entry->offset);
+        uLongf outBytes = bytes;
+        int status = uncompress((Bytef*)out, &outBytes, base_ + table[2*i], table[2*i + 1]);
+        return status == Z_OK && outBytes == bytes;
+    }
+
+    // Whole metric as a grid
+    VoxelGrid Grid(const std::string& metric) const {
+        return Grid(metric, 0, geometry_.nx);
+    }
+
+    // The x slabs [iBegin, iEnd) alone, in a grid of that size placed as
+    // in the full grid (VoxelGrid::Geometry::XSlabs)
+    VoxelGrid Grid(const std::string& metric, int iBegin, int iEnd) const {
+        iBegin = std::max(iBegin, 0);
+        iEnd = std::max(iBegin, std::min(iEnd, geometry_.nx));
+        VoxelGrid grid(geometry_.XSlabs(iBegin, iEnd));
+        const MetricEntry* entry = Find(metric);
+        if (!entry || iBegin >= iEnd) return grid;
+        if (entry->compression == kRaw) {
+            const std::size_t bytes = SlabSize() * sizeof(float);
+            WillNeed(entry->offset + iBegin * bytes, (iEnd - iBegin) * bytes);
+        }
+        for (int i = iBegin; i < iEnd; i++) {
+            ReadSlab(metric, i, grid.Data() + grid.Index(i - iBegin, 0, 0));
+        }
+        return grid;
+    }
+
+    // Slabs touching the x range [xLo, xHi] (mm), either by histogram axis
+    // or by the macro coordinate of VoxelGrid::X, so that masks built with
+    // BinBox or XSlab over that range only see loaded voxels
+    VoxelGrid GridInX(const std::string& metric, double xLo, double xHi) const {
+        int iBegin, iEnd;
+        SlabsInX(geometry_, xLo, xHi, iBegin, iEnd);
+        return Grid(metric, iBegin, iEnd);
+    }
+
+    // Slab range [iBegin, iEnd) of GridInX for geometry g, empty if none
+    static void SlabsInX(const VoxelGrid::Geometry& g, double xLo, double xHi, int& iBegin, int& iEnd) {
+        const double width = (g.xMax - g.xMin) / g.nx;
+        iBegin = g.nx;
+        iEnd = 0;
+        for (int i = 0; i < g.nx; i++) {
+            double lowEdge = g.xMin + i * width;
+            double x = (i + 1 - g.centreX) * g.dX;
+            bool inAxis = lowEdge + width >= xLo && lowEdge <= xHi;
+            bool inMacro = x >= xLo && x <= xHi;
+            if (inAxis || inMacro) {
+                iBegin = std::min(iBegin, i);
+                iEnd = i + 1;
+            }
+        }
+        if (iBegin >= iEnd) iBegin = iEnd = 0;
+    }
+
+    // True if the metric was a TH3D and lost precision when stored
+    bool Narrowed(const std::string& metric) const {
+        const MetricEntry* entry = Find(metric);
+        return entry && (entry->flags & kNarrowed);
+    }
+
+    // New histogram with the binning, title and entries of the original,
+    // detached from any file. Bin errors are the default sqrt(content) and
+    // the under/overflow bins are empty, see the header comment.
+    template <typename H = TH3F>
+    H* Histogram(const std::string& metric, const char* name) const {
+        const MetricEntry* entry = Find(metric);
+        if (!entry) return nullptr;
+        const auto& g = geometry_;
+        H* hist = new H(name, entry->title, g.nx, g.xMin, g.xMax,
+                        g.ny, g.yMin, g.yMax, g.nz, g.zMin, g.zMax);
+        hist->SetDirectory(0);
+        Grid(metric).ToHistogram(hist);
+        hist->SetEntries(entry->entries);
+        return hist;
+    }
+
+    // -----------------------------------------------------------------
+    // Writing
+
+    struct Plane {
+        std::string metric;
+        const VoxelGrid* grid;
+        std::string title;           // of the original histogram, truncated to 79 chars
+        double entries = 0;          // idem
+        bool narrowed = false;       // the original was a TH3D
+
+        // Title, entries and type taken from the histogram the grid was read from
+        static Plane Of(const std::string& metric, const VoxelGrid* grid, const TH3* hist) {
+            Plane plane{metric, grid};
+            plane.title = hist->GetTitle();
+            plane.entries = hist->GetEntries();
+            plane.narrowed = hist->InheritsFrom("TH3D");
+            return plane;
+        }
+    };
+
+    // All planes must share the geometry of the first one
+    static bool Write(const std::string& filename, const std::vector<Plane>& planes,
+                      Compression compression = kRaw) {
+        if (planes.empty()) return false;
+        const VoxelGrid::Geometry& g = planes[0].grid->GetGeometry();
+        for (const auto& plane : planes) {
+            const auto& other = plane.grid->GetGeometry();
+            if (other.nx != g.nx || other.ny != g.ny || other.nz != g.nz ||
+                plane.metric.size() >= sizeof(MetricEntry::name)) {
+                std::cerr << "Cannot store " << plane.metric << " in " << filename << std::endl;
+                return false;
+            }
+        }
+
+        // Written aside and renamed, so that a reader never maps a half-written file
+        const std::string tmpName = filename + ".tmp";
+        std::unique_ptr<FILE, int (*)(FILE*)> out(std::fopen(tmpName.c_str(), "wb"), std::fclose);
+        if (!out) {
+            std::cerr << "Cannot write voxel map " << tmpName << std::endl;
+            return false;
+        }
+
+        Header header;
+        std::memcpy(header.magic, kMagic, sizeof(header.magic));
+        header.version = kVersion;
+        header.nMetrics = planes.size();
+        SetGeometry(header, g);
+
+        std::vector<MetricEntry> entries(planes.size());
+        uint64_t offset = sizeof(Header) + planes.size() * sizeof(MetricEntry);
+        const std::size_t slab = (std::size_t)g.ny * g.nz;
+
+        // Compressed chunks are built first so that the offsets are known
+        std::vector<std::vector<std::vector<Bytef>>> chunks(planes.size());
+        for (std::size_t p = 0; p < planes.size(); p++) {
+            MetricEntry& entry = entries[p];
+            std::strncpy(entry.name, planes[p].metric.c_str(), sizeof(entry.name) - 1);
+            std::strncpy(entry.title, planes[p].title.c_str(), sizeof(entry.title) - 1);
+            entry.compression = compression;
+            entry.flags = planes[p].narrowed ? kNarrowed : 0;
+            entry.entries = planes[p].entries;
+            offset = PageAlign(offset);
+            entry.offset = offset;
+            if (compression == kRaw) {
+                entry.bytes = planes[p].grid->Size() * sizeof(float);
+            } else {
+                chunks[p].resize(g.nx);
+                entry.bytes = 2 * g.nx * sizeof(uint64_t);
+                for (int i = 0; i < g.nx; i++) {
+                    const Bytef* src = (const Bytef*)(planes[p].grid->Data() + (std::size_t)i * slab);
+                    uLongf size = compressBound(slab * sizeof(float));
+                    chunks[p][i].resize(size);
+                    if (compress2(chunks[p][i].data(), &size, src, slab * sizeof(float), Z_BEST_SPEED) != Z_OK) {
+                        std::cerr << "Cannot compress " << planes[p].metric << " for " << filename << std::endl;
+                        out.reset();
+                        std::remove(tmpName.c_str());
+                        return false;
+                    }
+                    chunks[p][i].resize(size);
+                    entry.bytes += size;
+                }
+            }
+            offset += entry.bytes;
+        }
+
+        bool ok = std::fwrite(&header, sizeof(header), 1, out.get()) == 1;
+        ok = ok && std::fwrite(entries.data(), sizeof(MetricEntry), entries.size(), out.get()) == entries.size();
+        for (std::size_t p = 0; ok && p < planes.size(); p++) {
+            ok = std::fseek(out.get(), entries[p].offset, SEEK_SET) == 0;
+            if (compression == kRaw) {
+                ok = ok && std::fwrite(planes[p].grid->Data(), sizeof(float),
+                                       planes[p].grid->Size(), out.get()) == planes[p].grid->Size();
+                continue;
+            }
+            std::vector<uint64_t> table(2 * g.nx);
+            uint64_t chunkOffset = entries[p].offset + table.size() * sizeof(uint64_t);
+            for (int i = 0; i < g.nx; i++) {
+                table[2*i] = chunkOffset;
+                table[2*i + 1] = chunks[p][i].size();
+                chunkOffset += chunks[p][i].size();
+            }
+            ok = ok && std::fwrite(table.data(), sizeof(uint64_t), table.size(), out.get()) == table.size();
+            for (int i = 0; ok && i < g.nx; i++) {
+                ok = std::fwrite(chunks[p][i].data(), 1, chunks[p][i].size(), out.get()) == chunks[p][i].size();
+            }
+        }
+        ok = ok && std::fflush(out.get()) == 0 && fsync(fileno(out.get())) == 0;
+        ok = std::fclose(out.release()) == 0 && ok;
+        ok = ok && std::rename(tmpName.c_str(), filename.c_str()) == 0;
+        if (!ok) {
+            std::cerr << "Error writing voxel map " << filename << std::endl;
+            std::remove(tmpName.c_str());
+        }
+        return ok;
+    }
+
+private:
+    static constexpr const char* kMagic = "VOXMAP\0";
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t nMetrics;
+        int32_t nx, ny, nz, unused;
+        double dX, dY, dZ;
+        double centreX, centreY, centreZ;
+        double xMin, yMin, zMin;
+        double xMax, yMax, zMax;
+    };
+
+    struct MetricEntry {
+        char name[48];
+        char title[80];
+        uint32_t compression;
+        uint32_t flags;
+        uint64_t offset;
+        uint64_t bytes;
+        double entries;
+    };
+
+    const uint8_t* base_ = nullptr;
+    std::size_t size_ = 0;
+    VoxelGrid::Geometry geometry_;
+    std::vector<const MetricEntry*> entries_;
+
+    VoxelMapFile(const uint8_t* base, std::size_t size) : base_(base), size_(size) {}
+
+    bool ParseHeader() {
+        const Header* header = (const Header*)base_;
+        if (std::memcmp(header->magic, kMagic, sizeof(header->magic)) != 0 ||
+            header->version != kVersion) return false;
+        if (header->nx <= 0 || header->ny <= 0 || header->nz <= 0) return false;
+        if (header->nMetrics > (size_ - sizeof(Header)) / sizeof(MetricEntry)) return false;
+
+        auto& g = geometry_;
+        g.nx = header->nx;
+        g.ny = header->ny;
+        g.nz = header->nz;
+        g.dX = header->dX;
+        g.dY = header->dY;
+        g.dZ = header->dZ;
+        g.centreX = header->centreX;
+        g.centreY = header->centreY;
+        g.centreZ = header->centreZ;
+        g.xMin = header->xMin;
+        g.yMin = header->yMin;
+        g.zMin = header->zMin;
+        g.xMax = header->xMax;
+        g.yMax = header->yMax;
+        g.zMax = header->zMax;
+
+        const MetricEntry* entry = (const MetricEntry*)(base_ + sizeof(Header));
+        for (uint32_t m = 0; m < header->nMetrics; m++, entry++) {
+            if (!ValidEntry(*entry)) return false;
+            entries_.push_back(entry);
+        }
+        return true;
+    }
+
+    // A plane must lie inside the mapping and hold exactly nx*ny*nz floats;
+    // for zlib every chunk of the offset table must lie inside the plane
+    bool ValidEntry(const MetricEntry& entry) const {
+        if (std::memchr(entry.name, 0, sizeof(entry.name)) == nullptr ||
+            std::memchr(entry.title, 0, sizeof(entry.title)) == nullptr) return false;
+        if (entry.offset > size_ || entry.bytes > size_ - entry.offset) return false;
+        if (entry.offset % sizeof(uint64_t) != 0) return false;
+
+        const uint64_t planeBytes = (uint64_t)geometry_.NVoxels() * sizeof(float);
+        if (entry.compression == kRaw) return entry.bytes == planeBytes;
+        if (entry.compression != kZlib) return false;
+
+        const uint64_t tableBytes = 2 * (uint64_t)geometry_.nx * sizeof(uint64_t);
+        if (entry.bytes < tableBytes) return false;
+        const uint64_t* table = (const uint64_t*)(base_ + entry.offset);
+        const uint64_t begin = entry.offset + tableBytes;
+        const uint64_t end = entry.offset + entry.bytes;
+        for (int i = 0; i < geometry_.nx; i++) {
+            uint64_t offset = table[2*i], bytes = table[2*i + 1];
+            if (offset < begin || offset > end || bytes > end - offset) return false;
+        }
+        return true;
+    }
+
+    static void SetGeometry(Header& header, const VoxelGrid::Geometry& g) {
+        header.nx = g.nx;
+        header.ny = g.ny;
+        header.nz = g.nz;
+        header.unused = 0;
+        header.dX = g.dX;
+        header.dY = g.dY;
+        header.dZ = g.dZ;
+        header.centreX = g.centreX;
+        header.centreY = g.centreY;
+        header.centreZ = g.centreZ;
+        header.xMin = g.xMin;
+        header.yMin = g.yMin;
+        header.zMin = g.zMin;
+        header.xMax = g.xMax;
+        header.yMax = g.yMax;
+        header.zMax = g.zMax;
+    }
+
+    const MetricEntry* Find(const std::string& metric) const {
+        for (auto entry : entries_) {
+            if (metric == entry->name) return entry;
+        }
+        return nullptr;
+    }
+
+    std::size_t SlabSize() const { return (std::size_t)geometry_.ny * geometry_.nz; }
+
+    static uint64_t PageAlign(uint64_t offset) {
+        const uint64_t page = 4096;
+        return (offset + page - 1) / page * page;
+    }
+
+    // Prefetch hint for the pages of [offset, offset + bytes)
+    void WillNeed(uint64_t offset, uint64_t bytes) const {
+        uint64_t page = sysconf(_SC_PAGE_SIZE);
+        uint64_t begin = offset / page * page;
+        madvise(const_cast<uint8_t*>(base_) + begin, offset + bytes - begin, MADV_WILLNEED);
+    }
+};
+
+// Drop-in body for the macros' LoadHistogram helpers. Reads the metric from
+// the .voxmap next to filepath (or from filepath itself if it is one) when
+// there is one, otherwise from the ROOT file as before. A histogram read
+// from the .voxmap has the title and entries of the original but no
+// under/overflow content nor stored errors, and float precision.
+template <typename H = TH3F>
+H* LoadVoxelHistogram(const char* filepath, const char* histname) {
+    std::string path(filepath);
+    std::string mapPath = path.size() > 7 && path.compare(path.size() - 7, 7, ".voxmap") == 0
+                        ? path : VoxelMapFile::PathFor(path);
+    if (VoxelMapFile::Exists(mapPath)) {
+        auto map = VoxelMapFile::Open(mapPath);
+        if (map && map->Has(histname)) return map->Histogram<H>(histname, histname);
+    }
+
+    std::unique_ptr<TFile> file(TFile::Open(filepath, "READ"));
+    if (!file || file->IsZombie()) {
+        std::cerr << "Error opening file: " << filepath << std::endl;
+        return nullptr;
+    }
+    H* hist = (H*)file->Get(histname);
+    if (hist) hist->SetDirectory(0);
+    return hist;
+}
+
+// Sub-volume reader for macros that only look at the x slab [xLo, xHi]
+// (mm). The grid only holds the slabs touching the range, placed as in the
+// full grid (VoxelGrid::Geometry::XSlabs), so masks and coordinates are
+// unchanged. With a .voxmap next to filepath only those slabs are read,
+// straight into the grid without a TH3; otherwise the histogram is read
+// from the ROOT file and only those slabs are copied. The voxel size
+// overrides those of the file when given, as in VoxelGrid::FromHistogram,
+// and is applied before the slabs are selected. nullptr if the metric
+// cannot be read or no slab touches the range.
+inline std::unique_ptr<VoxelGrid> LoadVoxelGridInX(const char* filepath, const char* metric,
+                                                   double xLo, double xHi,
+                                                   double dX = 0, double dY = 0, double dZ = 0) {
+    auto withVoxelSize = [&](VoxelGrid::Geometry g) {
+        if (dX > 0) g.dX = dX;
+        if (dY > 0) g.dY = dY;
+        if (dZ > 0) g.dZ = dZ;
+        return g;
+    };
+
+    std::string mapPath = VoxelMapFile::PathFor(filepath);
+    if (VoxelMapFile::Exists(mapPath)) {
+        auto map = VoxelMapFile::Open(mapPath);
+        if (map && map->Has(metric)) {
+            VoxelGrid::Geometry g = withVoxelSize(map->GetGeometry());
+            int iBegin, iEnd;
+            VoxelMapFile::SlabsInX(g, xLo, xHi, iBegin, iEnd);
+            if (iBegin >= iEnd) {
+                std::cerr << "No slab of " << metric << " in " << xLo << " < x < " << xHi << std::endl;
+                return nullptr;
+            }
+            auto grid = std::make_unique<VoxelGrid>(map->Grid(metric, iBegin, iEnd));
+            grid->SetVoxelSize(g.dX, g.dY, g.dZ);
+            return grid;
+        }
+    }
+
+    std::unique_ptr<TFile> file(TFile::Open(filepath, "READ"));
+    if (!file || file->IsZombie()) {
+        std::cerr << "Error opening file: " << filepath << std::endl;
+        return nullptr;
+    }
+    std::unique_ptr<TH3> hist(dynamic_cast<TH3*>(file->Get(metric)));
+    if (!hist) {
+        std::cerr << "No " << metric << " in " << filepath << std::endl;
+        return nullptr;
+    }
+    hist->SetDirectory(0);
+    VoxelGrid::Geometry g = VoxelGrid::HistogramGeometry(hist.get(), dX, dY, dZ);
+    int iBegin, iEnd;
+    VoxelMapFile::SlabsInX(g, xLo, xHi, iBegin, iEnd);
+    if (iBegin >= iEnd) {
+        std::cerr << "No slab of " << metric << " in " << xLo << " < x < " << xHi << std::endl;
+        return nullptr;
+    }
+    return std::make_unique<VoxelGrid>(VoxelGrid::FromHistogram(hist.get(), g, iBegin, iEnd));
+}
+
+#endif
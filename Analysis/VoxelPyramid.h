@@ -0,0 +1,147 @@
+// All voxel sizes from one reconstruction.
+//
+// Every voxel size used to be a separate discriminator run (..._1cmVoxel_,
+// ..._3cmVoxel_, ..._4cmvoxel). The per-voxel statistics of ExposureAccumulator
+// are additive, so a coarse voxel is simply the merge of the fine voxels it
+// covers: counts and sums add up, and the median comes from the summed
+// discriminator histograms rather than from the fine medians. VoxelPyramid
+// takes the statistics on a fine grid (1 cm) and rebins them by any integer
+// factor, optionally with the coarse grid origin shifted by whole fine voxels
+// for the aligned/shifted drum comparisons.
+
+#ifndef VOXEL_PYRAMID_H
+#define VOXEL_PYRAMID_H
+
+#include <deque>
+#include <future>
+#include <utility>
+#include <vector>
+
+#include "ExposureAccumulator.h"
+#include "ThreadPool.h"
+#include "TrackVoxelizer.h"
+
+class VoxelPyramid {
+public:
+    typedef ExposureAccumulator::State State;
+
+    // 1 cm voxels over 120 x 60 x 60 cm; every factor 1..5 divides the axes
+    static ExposureAccumulator::Config FineConfig() {
+        ExposureAccumulator::Config config;
+        config.x = {120, -600, 600};
+        config.y = {60, -300, 300};
+        config.z = {60, -300, 300};
+        config.medianBins = 128;   // 0.055 wide over the 7..14 window
+        return config;
+    }
+
+    // Fine statistics of one voxelization; the voxel and histogram arrays
+    // are moved out of the result, pass it with std::move
+    static State FromResult(TrackVoxelizer::Result result) {
+        ExposureAccumulator::Config config;
+        config.x = result.config.x;
+        config.y = result.config.y;
+        config.z = result.config.z;
+        config.discrMin = result.config.discrMin;
+        config.discrMax = result.config.discrMax;
+        config.medianBins = result.config.medianBins;
+
+        State state;
+        state.config = config;
+        state.geometry = ExposureAccumulator::MakeGeometry(config);
+        state.voxels = std::move(result.voxels);
+        state.discrHist = std::move(result.discrHist);
+        return state;
+    }
+
+    // Coarse voxel I merges the fine voxels i with (i + shift) / factor == I.
+    // A non-zero shift moves the coarse origin down by shift fine voxels; the
+    // partly covered voxels at the edges merge the fine voxels that exist.
+    static State Rebin(const State& fine, int factor, int shiftX = 0, int shiftY = 0,
+                       int shiftZ = 0, unsigned nThreads = 0) {
+        const int shift[3] = {shiftX % factor, shiftY % factor, shiftZ % factor};
+        const TrackVoxelizer::Axis* axes[3] = {&fine.config.x, &fine.config.y, &fine.config.z};
+
+        State coarse;
+        coarse.config = fine.config;
+        TrackVoxelizer::Axis* coarseAxes[3] = {&coarse.config.x, &coarse.config.y, &coarse.config.z};
+        for (int a = 0; a < 3; a++) {
+            const TrackVoxelizer::Axis& axis = *axes[a];
+            int n = (axis.nBins + shift[a] + factor - 1) / factor;
+            double width = axis.Width() * factor;
+            double min = axis.min - shift[a] * axis.Width();
+            *coarseAxes[a] = {n, min, min + n * width};
+        }
+        coarse.geometry = ExposureAccumulator::MakeGeometry(coarse.config);
+        // A shifted level is the aligned one moved down by the shift: its
+        // voxel I keeps the centre offset of aligned voxel I plus shift/factor
+        double* centre[3] = {&coarse.geometry.centreX, &coarse.geometry.centreY, &coarse.geometry.centreZ};
+        for (int a = 0; a < 3; a++) {
+            int nAligned = (axes[a]->nBins + factor - 1) / factor;
+            *centre[a] = nAligned / 2 + (double)shift[a] / factor;
+        }
+        coarse.voxels.resize(coarse.geometry.NVoxels());
+        coarse.discrHist.assign(coarse.geometry.NVoxels() * fine.config.medianBins, 0);
+
+        const auto& f = fine.geometry;
+        const auto& c = coarse.geometry;
+        const int nb = fine.config.medianBins;
+
+        // Coarse x slabs are independent: each one reads its own fine slabs
+        ThreadPool pool(nThreads);
+        std::vector<std::future<void>> pending;
+        for (int I = 0; I < c.nx; I++) {
+            pending.push_back(pool.Submit([&, I]() {
+                int iBegin = std::max(0, I * factor - shift[0]);
+                int iEnd = std::min(f.nx, (I + 1) * factor - shift[0]);
+                for (int i = iBegin; i < iEnd; i++) {
+                    for (int j = 0; j < f.ny; j++) {
+                        std::size_t fineRow = ((std::size_t)i * f.ny + j) * f.nz;
+                        std::size_t coarseRow = ((std::size_t)I * c.ny + (j + shift[1]) / factor) * c.nz;
+                        for (int k = 0; k < f.nz; k++) {
+                            std::size_t v = fineRow + k;
+                            if (fine.voxels[v].count == 0) continue;
+                            std::size_t V = coarseRow + (k + shift[2]) / factor;
+                            coarse.voxels[V].Merge(fine.voxels[v]);
+                            const uint32_t* src = &fine.discrHist[v * nb];
+                            uint32_t* dst = &coarse.discrHist[V * nb];
+                            for (int b = 0; b < nb; b++) dst[b] += src[b];
+                        }
+                    }
+                }
+            }));
+        }
+        for (auto& future : pending) future.get();
+        return coarse;
+    }
+
+    struct Level {
+        int factor;
+        int shift[3];
+        State state;
+    };
+
+    explicit VoxelPyramid(State fine) { levels_.push_back({1, {0, 0, 0}, std::move(fine)}); }
+
+    // Adds one rebinned level of the finest grid and returns it
+    const State& AddLevel(int factor, int shiftX = 0, int shiftY = 0, int shiftZ = 0,
+                          unsigned nThreads = 0) {
+        for (const auto& level : levels_) {
+            if (level.factor == factor && level.shift[0] == shiftX % factor &&
+                level.shift[1] == shiftY % factor && level.shift[2] == shiftZ % factor) {
+                return level.state;
+            }
+        }
+        levels_.push_back({factor, {shiftX % factor, shiftY % factor, shiftZ % factor},
+                           Rebin(levels_[0].state, factor, shiftX, shiftY, shiftZ, nThreads)});
+        return levels_.back().state;
+    }
+
+    const State& Fine() const { return levels_[0].state; }
+    const std::deque<Level>& Levels() const { return levels_; }
+
+private:
+    std::deque<Level> levels_;  // references stay valid as levels are added
+};
+
+#endif